@@ -21,15 +21,105 @@ static char *const rcpostinitfile[] = { "/bin/rc.postinit",         NULL };
 static char *const servstartcmd[]   = { "/sbin/kanrisha", "daemon", NULL };
 static char *const rcshutdownfile[] = { "/bin/rc.shutdown",         NULL };
 static char *const servstopcmd[]    = { "/sbin/kanrisha", "stop",   NULL };
+static char *const softrebootcmd[]  = { "/sbin/ichirou", "--soft-reboot", NULL };
+static char *const rescueshell[]    = { "/bin/sh",                  NULL };
+
+/* boot fragments run in parallel after rc.init */
+#define RCINITDIR       "/etc/rc.init.d"
+#define MAXFRAGMENTS    64
+
+/* at shutdown, syncing and remounting read-only give up on a
+   filesystem after SYNCDEADLINE seconds. the ones that take
+   longer than SLOWMOUNT seconds are named */
+#define SYNCDEADLINE    30
+#define SLOWMOUNT       1
+#define MAXMOUNTS       256
+
+/* rc.shutdown is killed after SHUTDOWNTIMEOUT seconds */
+#define SHUTDOWNTIMEOUT 30
+
+/* record the files opened until rc.postinit is done and read them
+   ahead on the next boot. comment out to disable */
+#define READAHEADLIST   "/var/lib/ichirou/readahead"
+#define READAHEADMAX    8192
 
 #define SIGKILLTIMEOUT  10
 #define MAXSERVICES     512
 #define MAXSVCRESTART   128
 
 #define LOGFILEPERMS    0600
-#define STATUSLOGLEN    "8"
+#define STATUSLOGLEN    8
+
+/* service output is archived in LOGARCHIVEDIR/<service>, compressed in
+   blocks of LOGBLOCKSIZE bytes or LOGFLUSH seconds, whichever comes
+   first. every service keeps LOGSEGMENTS segments of LOGSEGMENTSIZE
+   compressed bytes */
+#define LOGARCHIVEDIR   "/var/log/kanrisha"
+#define LOGBLOCKSIZE    65536
+#define LOGFLUSH        5
+#define LOGSEGMENTSIZE  (1 << 20)
+#define LOGSEGMENTS     16
+#define LOGCOMPRESSION  6
 
 #define WRITE_TO_SYSLOG
 #define WRITE_TO_OUTPUT
 
 #define CMDFIFOPATH     "/tmp/kanrisha.cmd.sock"
+/* the sockets live in a directory only root can write to. the control
+   socket is root's alone, the metrics one its group's as well */
+#define RUNTIMEDIR      "/run/kanrisha"
+#define CTLSOCKPATH     RUNTIMEDIR "/ctl.sock"
+#define SHMSTATEPATH    "/dev/shm/kanrisha.state"
+#define METRICSSOCKPATH RUNTIMEDIR "/metrics.sock"
+#define CTLSOCKPERMS    0600
+#define METRICSSOCKPERMS 0660
+/* uncomment to also serve metrics on 127.0.0.1 */
+/* #define METRICSPORT  9321 */
+#define MAXCLIENTS      16
+
+#define LOGRINGSIZE     1024
+#define LOGBATCH        64
+#define LOGMSGLEN       256
+/* uncomment to also write the daemon's log to a file */
+/* #define LOGFILEPATH  "/var/log/kanrisha.log" */
+
+#define JOURNALPATH     "/var/lib/kanrisha/journal"
+#define JOURNALRECORDS  65536
+
+/* the services compiled into one file, rebuilt whenever
+   /etc/kanrisha.d changes or by `kanrisha compile` */
+#define MANIFESTPATH    "/var/lib/kanrisha/manifest"
+
+/* `kanrisha start` starts services once the services in their
+   depends file are ready, the ones with the longest chain of
+   services waiting for them first, and at most STARTJOBS that
+   haven't reported ready yet at a time. services that don't report
+   ready within READYTIMEOUT seconds aren't waited for anymore.
+   how long each one took is remembered in TIMINGSPATH, as a moving
+   average where the last start weighs TIMINGWEIGHT */
+#define STARTJOBS       8
+#define READYTIMEOUT    90
+#define TIMINGSPATH     "/var/lib/kanrisha/timings"
+#define TIMINGWEIGHT    0.3
+
+/* memory pressure based load shedding. services with a shed file are
+   stopped or frozen, lowest priority first, whenever tasks stall on
+   memory for more than 150ms per second. they come back one by one
+   after PSIHOLDDOWN seconds without pressure. comment out PSITRIGGER
+   to disable. */
+#define PSIPATH         "/proc/pressure/memory"
+#define PSITRIGGER      "some 150000 1000000"
+#define PSIHOLDDOWN     60
+
+/* timer-activated services remember their last run here */
+#define TIMERSTAMPDIR   "/var/lib/kanrisha/timers"
+
+/* `kanrisha reload` sends this unless the service has a reloadsig
+   file, and waits this long for a reload command or for the service
+   to report ready again */
+#define RELOADSIGNAL    SIGHUP
+#define RELOADTIMEOUT   30
+
+/* reboot into a kernel loaded with kexec, if there is one, instead of
+   going through the firmware. `reboot -k` does that regardless */
+#define KEXECREBOOT
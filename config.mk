@@ -24,3 +24,4 @@ LD = $(CC)
 CPPFLAGS =
 CFLAGS   = -Wextra -Wall -Os -s
 LDFLAGS  = -s -static
+LDLIBS   = -lpthread -lz
@@ -16,13 +16,32 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 **/
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/reboot.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/fanotify.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LEN(x)  (sizeof (x) / sizeof *(x))
@@ -35,10 +54,41 @@ static void sigreap(void);
 static void sigreboot(void);
 static void sigfreboot(void);
 static void sigffreboot(void);
+static void sigkexec(void);
+static void sigfkexec(void);
+static void sigffkexec(void);
+static int kexecloaded(void);
+static void sigsoftreboot(void);
 static void sighalt(void);
 static void sigfhalt(void);
 static void sighibernate(void);
+static void termwait(void);
+static void finalaction(int cmd);
 static void spawnwait(char *const argv[]);
+static void spawnbounded(char *const argv[], int seconds);
+static int runinitd(char *dir);
+static int readfragments(char *dir);
+static void startfragment(int frag);
+static int fragmentindex(char *name);
+static void *fragmentoutput(void *arg);
+static void testinit(char *dir);
+static void report(char *event);
+static int bench(int argc, char *argv[]);
+static int benchchild(void *arg);
+static int writescript(char *dir, char *name, char *content);
+static double benchstat(double *values, int count, int which);
+static void markshutdown(void);
+static double monotime(void);
+static struct mounttable *readmounts(void);
+static void finalsync(void);
+static void *syncworker(void *arg);
+static void finalremount(void);
+static void *remountworker(void *arg);
+static int depthcompare(const void *a, const void *b);
+static int pendingmounts(struct mounttable *table);
+static void reportmounts(struct mounttable *table, char *what, double started);
+static void readaheadstart(void);
+static void readaheadstop(void);
 
 static struct {
     int signal;
@@ -52,6 +102,10 @@ static struct {
     { SIGINT,  sigreboot     },
     { SIGTERM, sigfreboot    },
     { SIGTTOU, sigffreboot   },
+    { SIGURG,  sigkexec      },
+    { SIGXCPU, sigfkexec     },
+    { SIGXFSZ, sigffkexec    },
+    { SIGPROF, sigsoftreboot },
     { SIGQUIT, sighalt       },
     { SIGPWR,  sigfhalt      },
     { SIGHUP,  sighibernate  },
@@ -60,27 +114,131 @@ static struct {
 #include "config.h"
 
 static sigset_t set;
+static int kexecrequested = 0;
+/* kexec_loaded as it was when shutdown began, see markshutdown() */
+static int kexecseen = 0;
 
-int main(void) {
-    /* init signal handlers */
+/* what we run. --test-init points these into a directory */
+static char *const *rcinit = rcinitfile;
+static char *const *rcpostinit = rcpostinitfile;
+static char *const *servstart = servstartcmd;
+static char *const *rcshutdown = rcshutdownfile;
+static char *const *servstop = servstopcmd;
+static char *const *softreboot = softrebootcmd;
+static char *const *rescue = rescueshell;
+
+static char *rcinitd = RCINITDIR;
+
+/* set in test mode, see testinit() */
+static char *testdir = NULL;
+static int reportfd = -1;
+
+/* a piece of rc.init.d, see runinitd() */
+static struct {
+    char name[64];
+    char path[512];
+    uint64_t after; /* fragments that have to finish first */
+    int critical; /* drop into the rescue shell if it fails */
+    int console; /* runs alone, on the console */
+    pid_t pid; /* 0 before it started, -1 once it finished */
+    int out; /* read end of its output pipe, see fragmentoutput() */
+    char line[256]; /* output that isn't a full line yet */
+    size_t linelen;
+} fragments[MAXFRAGMENTS];
+static int fragmentcount = 0;
+
+/* the mount table, see readmounts(). each shutdown phase reads its
+   own, since the threads of an earlier one may still be using theirs. */
+struct mountent {
+    int id;
+    int parent;
+    int depth; /* how many mounts it is on top of */
+    dev_t dev;
+    int readonly;
+    char point[PATH_MAX];
+    int done; /* set by the worker */
+    double took;
+};
+struct mounttable {
+    int count;
+    struct mountent mounts[MAXMOUNTS];
+};
+
+/* monotime() when shutdown began, see markshutdown() */
+static double shutdownat = 0;
+
+#ifdef READAHEADLIST
+static void *rareplay(void *arg);
+static void *rarecord(void *arg);
+static uint64_t raphys(char *path);
+static int racompare(const void *a, const void *b);
+static void rasave(void);
+
+struct rafile {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    uint64_t phys; /* where it starts on disk */
+    char *path;
+};
+
+/* boot readahead, see readaheadstart() */
+static struct rafile *rafiles = NULL;
+static int racount = 0;
+static int rafd = -1;
+static volatile int rastop = 0;
+static volatile int rastale = 0;
+static int rafailed = 0;
+static int radropped = 0;
+static pthread_t rarecorder;
+#endif
+
+int main(int argc, char *argv[]) {
     int signal;
-    sigfillset(&set);
-    sigprocmask(SIG_BLOCK, &set, NULL);
+    int soft = 0;
+    int arg;
 
     /* iterator var */
     size_t i;
 
+    for (arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--soft-reboot"))
+            soft = 1;
+        else if (!strcmp(argv[arg], "--test-init") && arg + 1 < argc)
+            testinit(argv[++arg]);
+        else if (!strcmp(argv[arg], "--bench"))
+            return bench(argc - arg, argv + arg);
+    }
+
+    /* init signal handlers */
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
     /* if not pid 1, exit */
     if (getpid() != 1) {
         fprintf(stderr, "This program must be run with PID 1\n");
         return 1;
     }
 
-    /* start system initialization script */
+    /* start system initialization script. after a soft reboot,
+       the system is still initialized, only userspace is new */
     chdir("/");
-    spawnwait(rcinitfile);
-    spawnwait(servstartcmd);
-    spawnwait(rcpostinitfile);
+    if (!soft && !testdir)
+        readaheadstart();
+    if (!soft) {
+        spawnwait(rcinit);
+        if (runinitd(rcinitd) != 0) {
+            fprintf(stderr, "CRITICAL: boot failed, dropping into rescue shell\n");
+            spawnwait(rescue);
+            sigreboot();
+        }
+    }
+    spawnwait(servstart);
+    spawnwait(rcpostinit);
+    report("postinit");
+    if (!soft && !testdir)
+        readaheadstop();
 
     /* handle signals */
     while (1) {
@@ -105,16 +263,15 @@ int main(void) {
  * runs shutdown rcfile and then powers off the system.
 **/
 static void sigpoweroff(void) {
-    /* stop services */
-    spawnwait(servstopcmd);
-    sigreap();
+    markshutdown();
 
-    /* ask processes to terminate */
-    kill(-1, SIGTERM);
+    /* stop services */
+    spawnwait(servstop);
     sigreap();
 
-    /* after SIGKILLTIMEOUT seconds, kill all processes */
-    sleep(SIGKILLTIMEOUT);
+    /* ask processes to terminate, giving
+       them up to SIGKILLTIMEOUT seconds */
+    termwait();
     sigfpoweroff();
 }
 
@@ -124,17 +281,23 @@ static void sigpoweroff(void) {
  * runs the shutdown rcfile and then powers off the system.
 **/
 static void sigfpoweroff(void) {
+    markshutdown();
+
     /* kill all processes */
     kill(-1, SIGKILL);
     sigreap();
 
     /* sync filesystems */
-    sync();
+    finalsync();
 
-    /* run rc.shutdown */
-    spawnwait(rcshutdownfile);
+    /* run rc.shutdown, which may hang on a filesystem */
+    spawnbounded(rcshutdown, SHUTDOWNTIMEOUT);
     sigreap();
 
+    /* make what's left read-only */
+    if (!testdir)
+        finalremount();
+
     /* power off system */
     sigffpoweroff();
 }
@@ -145,12 +308,7 @@ static void sigfpoweroff(void) {
 **/
 static void sigffpoweroff(void) {
     /* power off system */
-    if (vfork() == 0) {
-        reboot(RB_POWER_OFF);
-        _exit(EXIT_SUCCESS);
-    }
-    while (1)
-        sleep(1);
+    finalaction(RB_POWER_OFF);
 }
 
 /**
@@ -169,16 +327,15 @@ static void sigreap(void) {
  * runs shutdown rcfile and then reboots the system.
 **/
 static void sigreboot(void) {
-    /* stop services */
-    spawnwait(servstopcmd);
-    sigreap();
+    markshutdown();
 
-    /* ask processes to terminate */
-    kill(-1, SIGTERM);
+    /* stop services */
+    spawnwait(servstop);
     sigreap();
 
-    /* after SIGKILLTIMEOUT seconds, kill all processes */
-    sleep(SIGKILLTIMEOUT);
+    /* ask processes to terminate, giving
+       them up to SIGKILLTIMEOUT seconds */
+    termwait();
     sigfreboot();
 }
 
@@ -188,33 +345,79 @@ static void sigreboot(void) {
  * runs the shutdown rcfile and then reboots the system.
 **/
 static void sigfreboot(void) {
+    markshutdown();
+
     /* kill all processes */
     kill(-1, SIGKILL);
     sigreap();
 
     /* sync filesystems */
-    sync();
+    finalsync();
 
-    /* run rc.shutdown */
-    spawnwait(rcshutdownfile);
+    /* run rc.shutdown, which may hang on a filesystem */
+    spawnbounded(rcshutdown, SHUTDOWNTIMEOUT);
     sigreap();
 
+    /* make what's left read-only */
+    if (!testdir)
+        finalremount();
+
     /* reboot system */
     sigffreboot();
 }
 
 /**
  * this reboots the system with force level 2
- * it directly reboots the system.
+ * it directly reboots the system. if a kexec kernel
+ * is loaded and we may use it, it boots straight
+ * into that, skipping the firmware.
 **/
 static void sigffreboot(void) {
+#ifdef KEXECREBOOT
+    const int kexec = kexecloaded();
+#else
+    const int kexec = kexecrequested && kexecloaded();
+#endif
+    if (kexecrequested && !kexec)
+        fprintf(stderr, "no kexec kernel loaded, rebooting through firmware\n");
+
     /* reboot system */
-    if (vfork() == 0) {
-        reboot(RB_AUTOBOOT);
-        _exit(EXIT_SUCCESS);
-    }
-    while (1)
-        sleep(1);
+    finalaction(kexec ? RB_KEXEC : RB_AUTOBOOT);
+}
+
+/**
+ * these reboot the system into the kernel loaded with kexec,
+ * the same way and with the same force levels as a normal reboot.
+**/
+static void sigkexec(void) {
+    kexecrequested = 1;
+    sigreboot();
+}
+
+static void sigfkexec(void) {
+    kexecrequested = 1;
+    sigfreboot();
+}
+
+static void sigffkexec(void) {
+    kexecrequested = 1;
+    sigffreboot();
+}
+
+/**
+ * this checks if a kexec kernel is loaded. rc.shutdown
+ * usually unmounts /sys, so if we can't tell now, we go by
+ * what it said when shutdown began. unknown means no.
+**/
+static int kexecloaded(void) {
+    char loaded;
+    int fd = open("/sys/kernel/kexec_loaded", O_RDONLY);
+    if (fd < 0)
+        return kexecseen;
+    if (read(fd, &loaded, 1) != 1)
+        loaded = kexecseen ? '1' : '0';
+    close(fd);
+    return loaded == '1';
 }
 
 /**
@@ -223,26 +426,29 @@ static void sigffreboot(void) {
  * and then tells the kernel to halt.
 **/
 static void sighalt(void) {
-    /* stop services */
-    spawnwait(servstopcmd);
-    sigreap();
+    markshutdown();
 
-    /* ask processes to terminate */
-    kill(-1, SIGTERM);
+    /* stop services */
+    spawnwait(servstop);
     sigreap();
 
-    /* after SIGKILLTIMEOUT seconds, kill all processes */
-    sleep(SIGKILLTIMEOUT);
+    /* ask processes to terminate, giving
+       them up to SIGKILLTIMEOUT seconds */
+    termwait();
     kill(-1, SIGKILL);
     sigreap();
 
     /* sync filesystems */
-    sync();
+    finalsync();
 
-    /* run rc.shutdown */
-    spawnwait(rcshutdownfile);
+    /* run rc.shutdown, which may hang on a filesystem */
+    spawnbounded(rcshutdown, SHUTDOWNTIMEOUT);
     sigreap();
 
+    /* make what's left read-only */
+    if (!testdir)
+        finalremount();
+
     /* halt system */
     sigfhalt();
 }
@@ -253,12 +459,7 @@ static void sighalt(void) {
 **/
 static void sigfhalt(void) {
     /* halt system */
-    if (vfork() == 0) {
-        reboot(RB_HALT_SYSTEM);
-        _exit(EXIT_SUCCESS);
-    }
-    while (1)
-        sleep(1);
+    finalaction(RB_HALT_SYSTEM);
 }
 
 /**
@@ -269,14 +470,325 @@ static void sigfhalt(void) {
 **/
 static void sighibernate(void) {
     /* hibernate system */
+    finalaction(RB_SW_SUSPEND);
+}
+
+/**
+ * this restarts userspace without rebooting the kernel.
+ * it stops services, asks processes to terminate, kills
+ * them once they are all gone or after SIGKILLTIMEOUT
+ * seconds, syncs filesystems and then re-executes ichirou,
+ * which starts services and rc.postinit again.
+ * mounts and the kernel stay as they are.
+**/
+static void sigsoftreboot(void) {
+    markshutdown();
+
+    /* stop services */
+    spawnwait(servstop);
+    sigreap();
+
+    /* ask processes to terminate, giving
+       them up to SIGKILLTIMEOUT seconds */
+    termwait();
+
+    /* kill the rest */
+    kill(-1, SIGKILL);
+    sigreap();
+
+    /* sync filesystems, they stay mounted */
+    finalsync();
+
+    /* become the new ichirou, keeping pid 1 */
+    execv(softreboot[0], softreboot);
+    perror("execv");
+
+    /* the new one is broken, so keep this one */
+    spawnwait(servstart);
+    spawnwait(rcpostinit);
+    report("postinit");
+}
+
+/**
+ * this asks all processes to terminate and waits until
+ * they are gone, but no longer than SIGKILLTIMEOUT seconds.
+**/
+static void termwait(void) {
+    struct timespec tick = { 0, 100000000 };
+    pid_t chpid;
+    int i;
+
+    kill(-1, SIGTERM);
+    /* stopped processes can't terminate */
+    kill(-1, SIGCONT);
+
+    for (i = 0; i < SIGKILLTIMEOUT * 10; i++) {
+        /* every process descends from us, so
+           once we have no children, all are gone */
+        while ((chpid = waitpid(-1, NULL, WNOHANG)) > 0);
+        if (chpid < 0 && errno == ECHILD)
+            break;
+        nanosleep(&tick, NULL);
+    }
+    alarm(TIMEO);
+}
+
+/**
+ * this tells the kernel to power off, reboot, halt or
+ * hibernate. in test mode, it only reports that it would.
+**/
+static void finalaction(int cmd) {
+    if (shutdownat)
+        fprintf(stderr, "ichirou: shutdown took %.2fs\n", monotime() - shutdownat);
+
+    if (testdir) {
+        report("final");
+        if (cmd == (int)RB_SW_SUSPEND)
+            return;
+        _exit(EXIT_SUCCESS);
+    }
+
     if (vfork() == 0) {
-        reboot(RB_SW_SUSPEND);
+        reboot(cmd);
+        /* only returns if there is no kernel to kexec */
+        if (cmd == RB_KEXEC)
+            reboot(RB_AUTOBOOT);
         _exit(EXIT_SUCCESS);
     }
     while (1)
         sleep(1);
 }
 
+/**
+ * this runs the fragments in dir, concurrently wherever their
+ * ordering allows it. a fragment declares its ordering in its
+ * leading comment lines:
+ *   # after: udev fsck   - start only once these have finished
+ *   # before: mount      - the same, the other way round
+ *   # critical           - the boot fails if this fails
+ *   # console            - it may ask questions, so it runs alone,
+ *                          with the console as its terminal
+ * output is passed on line by line, prefixed with the fragment's
+ * name. returns nonzero if a critical fragment failed, once the
+ * fragments still running are done.
+**/
+static int runinitd(char *dir) {
+    int running = 0, done = 0, failed = 0, alone = 0;
+    int frag, i, status;
+    pid_t chpid;
+
+    if (readfragments(dir) != 0)
+        return 0;
+
+    while (done < fragmentcount) {
+        /* start whatever may start. with nothing running and
+           nothing startable, there's a cycle, so break it */
+        for (frag = 0; frag < fragmentcount && !failed && !alone; frag++) {
+            int waiting = 0;
+            for (i = 0; i < fragmentcount; i++) {
+                if ((fragments[frag].after >> i & 1) && fragments[i].pid != -1)
+                    waiting = 1;
+            }
+            if (fragments[frag].pid != 0 || waiting || (fragments[frag].console && running))
+                continue;
+            startfragment(frag);
+            alone = fragments[frag].console && fragments[frag].pid > 0;
+            running += fragments[frag].pid > 0;
+            done += fragments[frag].pid < 0;
+        }
+        for (frag = 0; frag < fragmentcount && !failed && !running; frag++) {
+            if (fragments[frag].pid != 0)
+                continue;
+            fprintf(stderr, "rc.init.d: ordering cycle, starting %s anyway\n", fragments[frag].name);
+            startfragment(frag);
+            alone = fragments[frag].console && fragments[frag].pid > 0;
+            running += fragments[frag].pid > 0;
+            done += fragments[frag].pid < 0;
+        }
+        if (!running)
+            break;
+
+        /* output is passed on by threads, so only wait here.
+           this also reaps what the fragments left behind */
+        if ((chpid = waitpid(-1, &status, 0)) > 0) {
+            for (frag = 0; frag < fragmentcount && fragments[frag].pid != chpid; frag++);
+            if (frag == fragmentcount)
+                continue;
+
+            fragments[frag].pid = -1;
+            alone &= !fragments[frag].console;
+            running--;
+            done++;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "rc.init.d: %s failed\n", fragments[frag].name);
+                failed |= fragments[frag].critical;
+            }
+        }
+    }
+    alarm(TIMEO);
+
+    return failed;
+}
+
+/**
+ * this reads the fragments in dir and their ordering.
+**/
+static int readfragments(char *dir) {
+    char line[512], *name, *saveptr;
+    struct dirent *ent;
+    DIR *dp;
+    FILE *fp;
+    int frag, other;
+
+    if (!(dp = opendir(dir)))
+        return 1;
+    while ((ent = readdir(dp)) && fragmentcount < MAXFRAGMENTS) {
+        frag = fragmentcount;
+        if (ent->d_name[0] == '.' || ent->d_name[strlen(ent->d_name) - 1] == '~'
+            || strlen(ent->d_name) >= sizeof(fragments[frag].name))
+            continue;
+        snprintf(fragments[frag].path, sizeof(fragments[frag].path), "%s/%s", dir, ent->d_name);
+        if (access(fragments[frag].path, X_OK) != 0)
+            continue;
+        snprintf(fragments[frag].name, sizeof(fragments[frag].name), "%.63s", ent->d_name);
+        fragments[frag].after = 0;
+        fragments[frag].critical = 0;
+        fragments[frag].console = 0;
+        fragments[frag].pid = 0;
+        fragments[frag].out = -1;
+        fragmentcount++;
+    }
+    closedir(dp);
+
+    for (frag = 0; frag < fragmentcount; frag++) {
+        if (!(fp = fopen(fragments[frag].path, "re")))
+            continue;
+        while (fgets(line, sizeof(line), fp) && line[0] == '#') {
+            int before = !strncmp(line, "# before:", 9);
+            if (!strncmp(line, "# critical", 10))
+                fragments[frag].critical = 1;
+            if (!strncmp(line, "# console", 9))
+                fragments[frag].console = 1;
+            if (!before && strncmp(line, "# after:", 8))
+                continue;
+
+            /* unknown names are fine, they just aren't installed */
+            for (name = strtok_r(line + (before ? 9 : 8), " \t\n", &saveptr); name;
+                 name = strtok_r(NULL, " \t\n", &saveptr)) {
+                if ((other = fragmentindex(name)) < 0 || other == frag)
+                    continue;
+                if (before)
+                    fragments[other].after |= (uint64_t)1 << frag;
+                else
+                    fragments[frag].after |= (uint64_t)1 << other;
+            }
+        }
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+/**
+ * this starts a fragment with its output going into a pipe, which
+ * a thread of its own drains. console fragments get the console
+ * instead, as their controlling terminal.
+**/
+static void startfragment(int frag) {
+    pthread_t thread;
+    int out[2] = { -1, -1 };
+
+    fragments[frag].linelen = 0;
+    if (!fragments[frag].console && pipe2(out, O_CLOEXEC) != 0)
+        perror("pipe2");
+    fragments[frag].out = out[0];
+
+    /* started first, so that there is a reader once it runs */
+    if (out[0] >= 0) {
+        if (pthread_create(&thread, NULL, fragmentoutput, (void *)(intptr_t)frag) == 0) {
+            pthread_detach(thread);
+        } else {
+            perror("pthread_create");
+            close(out[0]);
+            close(out[1]);
+            out[0] = out[1] = -1;
+        }
+    }
+
+    switch (fragments[frag].pid = fork()) {
+        case 0:
+            sigprocmask(SIG_UNBLOCK, &set, NULL);
+            setsid();
+            if (fragments[frag].console && isatty(0))
+                ioctl(0, TIOCSCTTY, 0);
+            if (out[1] >= 0) {
+                dup2(out[1], 1);
+                dup2(out[1], 2);
+            }
+            execl(fragments[frag].path, fragments[frag].path, (char *)NULL);
+            perror("execl");
+            _exit(1);
+        case -1:
+            perror("fork");
+            break;
+    }
+    /* the reader sees eof once this is gone from the
+       fragment and from whatever it left running */
+    if (out[1] >= 0)
+        close(out[1]);
+}
+
+static int fragmentindex(char *name) {
+    int frag;
+    for (frag = 0; frag < fragmentcount; frag++) {
+        if (!strcmp(fragments[frag].name, name))
+            return frag;
+    }
+    return -1;
+}
+
+/**
+ * this passes on the lines a fragment writes, prefixed with its
+ * name. daemons it starts often keep the pipe, so this goes on
+ * after the fragment is gone, until the last of them closes it.
+**/
+static void *fragmentoutput(void *arg) {
+    int frag = (intptr_t)arg;
+    char buf[512];
+    ssize_t count;
+    size_t i;
+
+    while ((count = read(fragments[frag].out, buf, sizeof(buf))) != 0) {
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < (size_t)count; i++) {
+            if (buf[i] != '\n' && fragments[frag].linelen < sizeof(fragments[frag].line) - 1) {
+                fragments[frag].line[fragments[frag].linelen++] = buf[i];
+                continue;
+            }
+            fragments[frag].line[fragments[frag].linelen] = '\0';
+            printf("[%s] %s\n", fragments[frag].name, fragments[frag].line);
+            fragments[frag].linelen = 0;
+            if (buf[i] != '\n')
+                i--;
+        }
+        fflush(stdout);
+    }
+
+    if (fragments[frag].linelen) {
+        fragments[frag].line[fragments[frag].linelen] = '\0';
+        printf("[%s] %s\n", fragments[frag].name, fragments[frag].line);
+        fflush(stdout);
+    }
+    close(fragments[frag].out);
+
+    return NULL;
+}
+
 static void spawnwait(char *const argv[]) {
     pid_t chpid = fork();
     switch (chpid) {
@@ -293,3 +805,725 @@ static void spawnwait(char *const argv[]) {
             waitpid(chpid, NULL, WUNTRACED);
     }
 }
+
+/**
+ * this runs argv like spawnwait(), but kills it and whatever
+ * it started once it took longer than seconds.
+**/
+static void spawnbounded(char *const argv[], int seconds) {
+    struct timespec tick = { 0, 10000000 };
+    pid_t chpid = fork();
+    int i;
+
+    switch (chpid) {
+        case 0:
+            sigprocmask(SIG_UNBLOCK, &set, NULL);
+            setsid();
+            execvp(argv[0], argv);
+            perror("execvp");
+            _exit(1);
+        case -1:
+            perror("fork");
+            return;
+    }
+
+    for (i = 0; i < seconds * 100; i++) {
+        if (waitpid(chpid, NULL, WNOHANG) != 0)
+            return;
+        nanosleep(&tick, NULL);
+    }
+    fprintf(stderr, "ichirou: %s didn't finish within %ds, killing it\n", argv[0], seconds);
+    /* setsid() made it a process group of its own. one stuck
+       in the kernel won't die, so it isn't waited for */
+    kill(-chpid, SIGKILL);
+}
+
+/**
+ * this switches to test mode: the rc files and service commands
+ * are taken from dir, events are reported on fd 3 and the final
+ * reboot(2) is left out. run that way as pid 1 of a pid namespace,
+ * ichirou can be tested without a vm. see bench().
+**/
+static void testinit(char *dir) {
+    static char *cmds[6][2];
+    static char *soft[5];
+    char *names[6] = { "rc.init", "rc.postinit", "servstart", "rc.shutdown", "servstop", "rescue" };
+    size_t i, len = strlen(dir) + 16;
+
+    for (i = 0; i < LEN(names); i++) {
+        if (!(cmds[i][0] = malloc(len)))
+            exit(1);
+        snprintf(cmds[i][0], len, "%s/%s", dir, names[i]);
+        cmds[i][1] = NULL;
+    }
+    rcinit = cmds[0];
+    rcpostinit = cmds[1];
+    servstart = cmds[2];
+    rcshutdown = cmds[3];
+    servstop = cmds[4];
+    rescue = cmds[5];
+
+    soft[0] = "/proc/self/exe";
+    soft[1] = "--test-init";
+    soft[2] = dir;
+    soft[3] = "--soft-reboot";
+    soft[4] = NULL;
+    softreboot = soft;
+
+    if (!(rcinitd = malloc(len)))
+        exit(1);
+    snprintf(rcinitd, len, "%s/rc.init.d", dir);
+
+    testdir = dir;
+    if (fcntl(3, F_GETFD) != -1)
+        reportfd = 3;
+}
+
+/**
+ * this tells the test driver that event happened, and when.
+**/
+static void report(char *event) {
+    struct timespec now;
+
+    if (reportfd < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dprintf(reportfd, "%s %lld\n", event, (long long)now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+struct benchrun {
+    char *dir;
+    int report[2];
+    int sync[2];
+};
+
+/**
+ * this measures boot, soft reboot and power off end to end.
+ * every run starts ichirou in test mode as pid 1 of a fresh
+ * user, pid and mount namespace, with rc files that start
+ * services (-s) and other processes (-n), and times it from
+ * exec to rc.postinit and from signal to the final action.
+ * runs as any user on any linux box with user namespaces.
+**/
+static int bench(int argc, char *argv[]) {
+    static char stack[65536];
+    char dir[] = "/tmp/ichirou-bench.XXXXXX";
+    char buf[512], event[32];
+    int procs = 100, servs = 10, runs = 5;
+    int opt, run, phase;
+    long long stamp;
+    double *times[3];
+    struct benchrun br;
+    struct timespec start;
+    char *phases[3] = { "boot", "soft reboot", "poweroff" };
+    int signals[3] = { 0, SIGPROF, SIGUSR1 };
+    char *expect[3] = { "postinit", "postinit", "final" };
+
+    while ((opt = getopt(argc, argv, "n:s:r:")) != -1) {
+        switch (opt) {
+            case 'n': procs = atoi(optarg); break;
+            case 's': servs = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: ichirou --bench [-n processes] [-s services] [-r runs]\n");
+                return 1;
+        }
+    }
+    if (runs < 1)
+        runs = 1;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(buf, sizeof(buf), "#!/bin/sh\n: > %s/servpids\ni=0\nwhile [ $i -lt %d ]; do\n"
+             "    sleep 100000 &\n    echo $! >> %s/servpids\n    i=$((i + 1))\ndone\n", dir, servs, dir);
+    writescript(dir, "servstart", buf);
+    snprintf(buf, sizeof(buf), "#!/bin/sh\nkill $(cat %s/servpids) 2> /dev/null\nexit 0\n", dir);
+    writescript(dir, "servstop", buf);
+    snprintf(buf, sizeof(buf), "#!/bin/sh\ni=0\nwhile [ $i -lt %d ]; do\n"
+             "    sleep 100000 &\n    i=$((i + 1))\ndone\n", procs);
+    writescript(dir, "rc.postinit", buf);
+    writescript(dir, "rc.init", "#!/bin/sh\nexit 0\n");
+    writescript(dir, "rc.shutdown", "#!/bin/sh\nexit 0\n");
+
+    for (phase = 0; phase < 3; phase++) {
+        if (!(times[phase] = calloc(runs, sizeof(double))))
+            return 1;
+    }
+
+    printf("%d services, %d processes\n%-4s %12s %12s %12s\n", servs, procs, "run", "boot", "soft reboot", "poweroff");
+    for (run = 0; run < runs; run++) {
+        br.dir = dir;
+        if (pipe(br.report) != 0 || pipe2(br.sync, O_CLOEXEC) != 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = clone(benchchild, stack + sizeof(stack),
+                          CLONE_NEWUSER | CLONE_NEWPID | CLONE_NEWNS | SIGCHLD, &br);
+        if (pid < 0) {
+            perror("clone");
+            return 1;
+        }
+
+        /* become root in there, so that we may be pid 1 */
+        snprintf(buf, sizeof(buf), "/proc/%d/setgroups", pid);
+        writescript(buf, NULL, "deny");
+        snprintf(buf, sizeof(buf), "/proc/%d/uid_map", pid);
+        snprintf(event, sizeof(event), "0 %d 1", getuid());
+        writescript(buf, NULL, event);
+        snprintf(buf, sizeof(buf), "/proc/%d/gid_map", pid);
+        snprintf(event, sizeof(event), "0 %d 1", getgid());
+        writescript(buf, NULL, event);
+        close(br.sync[0]);
+        close(br.sync[1]);
+        close(br.report[1]);
+
+        FILE *reports = fdopen(br.report[0], "r");
+        for (phase = 0; phase < 3; phase++) {
+            if (signals[phase]) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                kill(pid, signals[phase]);
+            }
+            if (!fgets(buf, sizeof(buf), reports) || sscanf(buf, "%31s %lld", event, &stamp) != 2
+                || strcmp(event, expect[phase])) {
+                fprintf(stderr, "ichirou didn't get through %s\n", phases[phase]);
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                return 1;
+            }
+            times[phase][run] = (stamp - (start.tv_sec * 1000000000LL + start.tv_nsec)) / 1e6;
+        }
+        fclose(reports);
+        waitpid(pid, NULL, 0);
+
+        printf("%-4d %10.1fms %10.1fms %10.1fms\n", run + 1, times[0][run], times[1][run], times[2][run]);
+    }
+
+    char *stats[3] = { "min", "med", "max" };
+    for (opt = 0; opt < 3; opt++) {
+        printf("%-4s %10.1fms %10.1fms %10.1fms\n", stats[opt], benchstat(times[0], runs, opt),
+               benchstat(times[1], runs, opt), benchstat(times[2], runs, opt));
+    }
+
+    /* the scripts */
+    char *names[6] = { "rc.init", "rc.postinit", "servstart", "rc.shutdown", "servstop", "servpids" };
+    for (opt = 0; opt < 6; opt++) {
+        snprintf(buf, sizeof(buf), "%s/%s", dir, names[opt]);
+        unlink(buf);
+    }
+    rmdir(dir);
+
+    return 0;
+}
+
+/**
+ * this becomes pid 1 of the benchmark namespace, once
+ * bench() has mapped our uid.
+**/
+static int benchchild(void *arg) {
+    struct benchrun *br = arg;
+    char c;
+
+    close(br->sync[1]);
+    if (read(br->sync[0], &c, 1) < 0)
+        _exit(1);
+    close(br->report[0]);
+    if (br->report[1] != 3) {
+        dup2(br->report[1], 3);
+        close(br->report[1]);
+    }
+
+    /* don't let our mounts leak out, and see our own pids */
+    mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+    mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+
+    execl("/proc/self/exe", "ichirou", "--test-init", br->dir, NULL);
+    perror("execl");
+    _exit(1);
+}
+
+/**
+ * this writes content to dir/name, or to dir if
+ * name is NULL. scripts are made executable.
+**/
+static int writescript(char *dir, char *name, char *content) {
+    char path[512];
+    int fd;
+
+    if (name)
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+    else
+        snprintf(path, sizeof(path), "%s", dir);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, name ? 0755 : 0644)) < 0
+        || write(fd, content, strlen(content)) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * this returns the min (which 0), median (1) or max (2) of values.
+**/
+static double benchstat(double *values, int count, int which) {
+    double sorted[count];
+    double tmp;
+    int i, j;
+
+    memcpy(sorted, values, count * sizeof(double));
+    for (i = 1; i < count; i++) {
+        for (j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+            tmp = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = tmp;
+        }
+    }
+    return which == 0 ? sorted[0] : which == 1 ? sorted[count / 2] : sorted[count - 1];
+}
+
+/**
+ * this notes when shutdown began, for the
+ * total time finalaction() reports.
+**/
+static void markshutdown(void) {
+    if (shutdownat == 0) {
+        shutdownat = monotime();
+        kexecseen = kexecloaded();
+    }
+}
+
+static double monotime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * this reads the mount table into a newly allocated one.
+ * returns NULL if it can't.
+**/
+static struct mounttable *readmounts(void) {
+    char line[PATH_MAX * 2], point[PATH_MAX], opts[256];
+    unsigned int major, minor;
+    int id, parent, i, j;
+    struct mounttable *table;
+    struct mountent *mounts;
+    char *in, *out;
+    FILE *fp;
+
+    if (!(table = calloc(1, sizeof(*table)))) {
+        perror("readmounts");
+        return NULL;
+    }
+    mounts = table->mounts;
+    if (!(fp = fopen("/proc/self/mountinfo", "re"))) {
+        perror("/proc/self/mountinfo");
+        return table;
+    }
+    while (fgets(line, sizeof(line), fp) && table->count < MAXMOUNTS) {
+        if (sscanf(line, "%d %d %u:%u %*s %4095s %255s", &id, &parent, &major, &minor, point, opts) != 6)
+            continue;
+
+        /* spaces and such are octal escapes, like \040 */
+        for (in = out = point; *in; out++) {
+            if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] && in[3]) {
+                *out = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+                in += 4;
+            } else {
+                *out = *in++;
+            }
+        }
+        *out = '\0';
+
+        mounts[table->count].id = id;
+        mounts[table->count].parent = parent;
+        mounts[table->count].dev = makedev(major, minor);
+        mounts[table->count].readonly = !strncmp(opts, "ro", 2) && (opts[2] == ',' || opts[2] == '\0');
+        snprintf(mounts[table->count].point, sizeof(mounts[table->count].point), "%s", point);
+        table->count++;
+    }
+    fclose(fp);
+
+    /* depth in the mount tree, children have to go first */
+    for (i = 0; i < table->count; i++) {
+        int depth = 0, cur = i;
+        while (depth < table->count) {
+            for (j = 0; j < table->count && mounts[j].id != mounts[cur].parent; j++);
+            if (j == table->count || j == cur)
+                break;
+            cur = j;
+            depth++;
+        }
+        mounts[i].depth = depth;
+    }
+
+    return table;
+}
+
+/**
+ * this syncs every filesystem in a thread of its own, so
+ * one slow filesystem doesn't hold up the others, and waits
+ * for them for at most SYNCDEADLINE seconds. a hung one is
+ * left behind, and named.
+**/
+static void finalsync(void) {
+    pthread_t thread;
+    double started = monotime();
+    struct mounttable *table;
+    struct mountent *mounts;
+    int i, j;
+
+    if (!(table = readmounts()))
+        return;
+    mounts = table->mounts;
+    for (i = 0; i < table->count; i++) {
+        /* once per filesystem, not per bind mount */
+        for (j = 0; j < i && mounts[j].dev != mounts[i].dev; j++);
+        if (j < i || pthread_create(&thread, NULL, syncworker, &mounts[i]) != 0) {
+            mounts[i].done = 1;
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    while (pendingmounts(table) && monotime() - started < SYNCDEADLINE)
+        nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+
+    reportmounts(table, "syncing", started);
+}
+
+static void *syncworker(void *arg) {
+    struct mountent *mnt = arg;
+    double started = monotime();
+
+    int fd = open(mnt->point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+    }
+    mnt->took = monotime() - started;
+    __atomic_store_n(&mnt->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/**
+ * this remounts every filesystem read-only, mounts before
+ * the mounts they are on, in a thread, so that we can give
+ * up after SYNCDEADLINE seconds if one hangs.
+**/
+static void finalremount(void) {
+    pthread_t thread;
+    double started = monotime();
+    struct mounttable *table;
+
+    if (!(table = readmounts()))
+        return;
+    qsort(table->mounts, table->count, sizeof(*table->mounts), depthcompare);
+    if (pthread_create(&thread, NULL, remountworker, table) != 0) {
+        free(table);
+        return;
+    }
+    pthread_detach(thread);
+
+    while (pendingmounts(table) && monotime() - started < SYNCDEADLINE)
+        nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+
+    reportmounts(table, "remounting", started);
+}
+
+static void *remountworker(void *arg) {
+    struct mounttable *table = arg;
+    struct mountent *mnt;
+    /* the table may be freed as soon as the last one is done */
+    int i, count = table->count;
+
+    for (i = 0; i < count; i++) {
+        double started = monotime();
+        mnt = &table->mounts[i];
+        if (!mnt->readonly)
+            mount(NULL, mnt->point, NULL, MS_REMOUNT | MS_RDONLY, NULL);
+        mnt->took = monotime() - started;
+        __atomic_store_n(&mnt->done, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static int depthcompare(const void *a, const void *b) {
+    const struct mountent *x = a, *y = b;
+    return y->depth - x->depth;
+}
+
+static int pendingmounts(struct mounttable *table) {
+    int i, pending = 0;
+
+    for (i = 0; i < table->count; i++)
+        pending += !__atomic_load_n(&table->mounts[i].done, __ATOMIC_ACQUIRE);
+    return pending;
+}
+
+/**
+ * this names the mounts that were slow, or didn't finish at all,
+ * and says how long it all took. the table is freed unless a
+ * worker that gave up on is still using it.
+**/
+static void reportmounts(struct mounttable *table, char *what, double started) {
+    struct mountent *mnt;
+    int i;
+
+    for (i = 0; i < table->count; i++) {
+        mnt = &table->mounts[i];
+        if (!__atomic_load_n(&mnt->done, __ATOMIC_ACQUIRE))
+            fprintf(stderr, "ichirou: %s %s didn't finish within %ds, giving up on it\n",
+                    what, mnt->point, SYNCDEADLINE);
+        else if (mnt->took >= SLOWMOUNT)
+            fprintf(stderr, "ichirou: %s %s took %.1fs\n", what, mnt->point, mnt->took);
+    }
+    fprintf(stderr, "ichirou: %s %d mounts took %.2fs\n", what, table->count, monotime() - started);
+
+    if (!pendingmounts(table))
+        free(table);
+}
+
+#ifdef READAHEADLIST
+/**
+ * this starts boot readahead. if there is a list from an earlier
+ * boot, a thread reads its files into the page cache, in the order
+ * they are on disk. if there is none, another thread records the
+ * files opened during this boot, for readaheadstop() to save.
+**/
+static void readaheadstart(void) {
+    pthread_t thread;
+    FILE *fp;
+
+    if ((fp = fopen(READAHEADLIST, "re"))) {
+        if (pthread_create(&thread, NULL, rareplay, fp) == 0)
+            pthread_detach(thread);
+        else
+            fclose(fp);
+        return;
+    }
+
+    /* paths are resolved through /proc, which rc.init hasn't mounted yet */
+    if (access("/proc/self/fd", F_OK) != 0
+        && mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) {
+        perror("readahead: mount /proc");
+        return;
+    }
+
+    if ((rafd = fanotify_init(FAN_CLASS_NOTIF | FAN_UNLIMITED_QUEUE, O_RDONLY | O_LARGEFILE | O_CLOEXEC)) < 0) {
+        perror("fanotify_init");
+        return;
+    }
+    if (fanotify_mark(rafd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, "/") != 0
+        || pthread_create(&rarecorder, NULL, rarecord, NULL) != 0) {
+        perror("readaheadstart");
+        close(rafd);
+        rafd = -1;
+    }
+}
+
+/**
+ * this ends boot readahead once boot is done. it saves what was
+ * recorded, or throws the list away if its files changed, so
+ * that the next boot records a new one.
+**/
+static void readaheadstop(void) {
+    int i;
+
+    if (rafd < 0) {
+        if (rastale && unlink(READAHEADLIST) == 0)
+            fprintf(stderr, "readahead: files changed, recording again on next boot\n");
+        return;
+    }
+
+    rastop = 1;
+    pthread_join(rarecorder, NULL);
+    if (!rafailed)
+        close(rafd);
+    rafd = -1;
+    if (radropped)
+        fprintf(stderr, "readahead: %d files left out, their paths could not be resolved\n", radropped);
+
+    /* the disk reads them faster in this order */
+    for (i = 0; i < racount; i++)
+        rafiles[i].phys = raphys(rafiles[i].path);
+    qsort(rafiles, racount, sizeof(*rafiles), racompare);
+    rasave();
+
+    for (i = 0; i < racount; i++)
+        free(rafiles[i].path);
+    free(rafiles);
+    rafiles = NULL;
+    racount = 0;
+}
+
+/**
+ * this reads the files of fp ahead. files that changed since
+ * they were recorded are skipped and make the list stale.
+**/
+static void *rareplay(void *arg) {
+    static char line[PATH_MAX + 64];
+    FILE *fp = arg;
+    long long mtime, size;
+    struct stat st;
+    int fd, offset;
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %lld %n", &mtime, &size, &offset) != 2)
+            continue;
+        if ((fd = open(line + offset, O_RDONLY | O_NOATIME | O_CLOEXEC)) < 0
+            && (fd = open(line + offset, O_RDONLY | O_CLOEXEC)) < 0) {
+            rastale = 1;
+            continue;
+        }
+        if (fstat(fd, &st) != 0 || st.st_mtime != mtime || st.st_size != size)
+            rastale = 1;
+        else
+            readahead(fd, 0, size);
+        close(fd);
+    }
+    fclose(fp);
+
+    return NULL;
+}
+
+/**
+ * this records the regular files opened on the root filesystem
+ * until readaheadstop() says boot is done. our own opens, and
+ * files seen before, are left out.
+**/
+static void *rarecord(void *arg) {
+    char buf[8192], link[64], path[PATH_MAX];
+    struct fanotify_event_metadata *ev;
+    struct pollfd pfd = { .fd = rafd, .events = POLLIN };
+    struct rafile *grown;
+    struct stat st;
+    ssize_t len;
+    int i;
+
+    (void)arg;
+    while (!rastop && !rafailed) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        if ((len = read(rafd, buf, sizeof(buf))) <= 0)
+            continue;
+
+        for (ev = (void *)buf; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+            if (ev->fd < 0)
+                continue;
+            if (rafailed || ev->pid == getpid() || racount == READAHEADMAX
+                || fstat(ev->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+                close(ev->fd);
+                continue;
+            }
+            for (i = 0; i < racount && (rafiles[i].ino != st.st_ino || rafiles[i].dev != st.st_dev); i++);
+
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+            ssize_t plen = readlink(link, path, sizeof(path) - 1);
+            close(ev->fd);
+            if (i < racount)
+                continue;
+            if (plen <= 0) {
+                radropped++;
+                continue;
+            }
+            path[plen] = '\0';
+
+            if (!(racount % 256)) {
+                if (!(grown = realloc(rafiles, (racount + 256) * sizeof(*rafiles)))) {
+                    rafailed = 1;
+                    continue;
+                }
+                rafiles = grown;
+            }
+            rafiles[racount].dev = st.st_dev;
+            rafiles[racount].ino = st.st_ino;
+            rafiles[racount].size = st.st_size;
+            rafiles[racount].mtime = st.st_mtime;
+            rafiles[racount].phys = 0;
+            if (!(rafiles[racount].path = strdup(path))) {
+                rafailed = 1;
+                continue;
+            }
+            racount++;
+        }
+    }
+
+    /* out of memory, what we have is still worth saving */
+    if (rafailed) {
+        fprintf(stderr, "readahead: out of memory, stopped recording\n");
+        close(rafd);
+    }
+
+    return NULL;
+}
+
+/**
+ * this returns where path starts on disk, or 0 if we can't tell.
+**/
+static uint64_t raphys(char *path) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) != 0 || fm.map.fm_mapped_extents == 0)
+        fm.extent.fe_physical = 0;
+    close(fd);
+
+    return fm.extent.fe_physical;
+}
+
+static int racompare(const void *a, const void *b) {
+    const struct rafile *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return (x->phys > y->phys) - (x->phys < y->phys);
+}
+
+/**
+ * this writes the list, next to it first, so
+ * that a crash never leaves half a list behind.
+**/
+static void rasave(void) {
+    char tmp[sizeof(READAHEADLIST) + 4];
+    char dir[sizeof(READAHEADLIST)];
+    FILE *fp;
+    int i;
+
+    snprintf(dir, sizeof(dir), "%s", READAHEADLIST);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0755);
+
+    snprintf(tmp, sizeof(tmp), "%s.new", READAHEADLIST);
+    if (!(fp = fopen(tmp, "we"))) {
+        perror(tmp);
+        return;
+    }
+    for (i = 0; i < racount; i++)
+        fprintf(fp, "%lld %lld %s\n", (long long)rafiles[i].mtime, (long long)rafiles[i].size, rafiles[i].path);
+    if (fclose(fp) != 0 || rename(tmp, READAHEADLIST) != 0) {
+        perror(READAHEADLIST);
+        unlink(tmp);
+    }
+}
+#else
+static void readaheadstart(void) {}
+static void readaheadstop(void) {}
+#endif
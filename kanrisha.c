@@ -19,9 +19,11 @@
  *
  * kanrisha list - list all available services
  * kanrisha list enabled - list enabled services
- * kanrisha list running - list running services
- * kanrisha log service - show latest log of service
- * kanrisha status service - show status of service
+ * kanrisha list running [--json] - list running services
+ * kanrisha list timers [--json] - list timer-activated services by next run
+ * kanrisha log service [--since time] [--until time] [--grep pattern] - show log of service
+ * kanrisha status [--all] [--json] - show status of all services
+ * kanrisha status service [--json] - show status of service
  * kanrisha enable service - enable service
  * kanrisha disable service - disable service
  * kanrisha start - start all enabled services
@@ -29,13 +31,22 @@
  * kanrisha stop - stop all running services
  * kanrisha stop service - stop service
  * kanrisha restart service - restart service
+ * kanrisha reload service - reload configuration of service
+ * kanrisha isolate target - switch to the services of target
+ * kanrisha history service [--since time] - show start/stop history of service
+ * kanrisha metrics - print daemon metrics
+ * kanrisha compile - rebuild the service manifest
+ * kanrisha timings - show how long services take to get ready
 **/
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <dirent.h>
@@ -43,29 +54,174 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <regex.h>
+#include <zlib.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+
+struct histogram;
+struct outbuf;
+struct client;
+struct service;
+struct servconf;
+struct schedule;
+struct servstate;
+struct statepage;
+struct journal;
+struct logindex;
+struct manifest;
+struct manifestent;
 
 void malloc_fail();
+void sys_log(int priority, char *servname, char *format, ...);
+void log_write(int priority, struct timespec *time, char *servname, char *message);
+int log_start();
+void *log_writer(void *arg);
 void sys_perror(char *description);
 void sys_eprintf(char *format, char *servname);
 void sys_wprintf(char *format, char *servname);
 void sys_iprintf(char *format, char *servname);
 void sys_cprintf(char *format, unsigned char command, int retval);
 void help();
+struct servlist get_available_servs();
 struct servlist get_running_servs();
 struct servlist get_enabled_servs();
+struct servlist get_target_servs(char target[]);
 int list(int only_enabled, int only_running);
-int showlog(char servname[]);
+int showlog(char servname[], time_t since, time_t until, char *pattern);
 int status(char servname[]);
 int enable_serv(char servname[]);
 int disable_serv(char servname[]);
+struct service *find_serv(char servname[]);
+struct service *add_serv(char servname[]);
 int start_serv(char servname[]);
+void get_servtext(char servname[], char key[], char *buf, size_t len);
+double plan_chain(struct service *serv);
+void plan_start(struct servlist *servs);
 int start_all();
+void plan_advance();
+int plan_timeout();
+void serv_ready(struct service *serv);
+void timings_load();
+void timings_save();
+int timings();
 int stop_serv(char servname[]);
+int stop_servs(struct service **servs, int count);
+void stop_done(struct service *serv);
+void stop_advance();
+int stop_timeout();
 int stop_all();
+int isolate(char target[]);
 int restart_serv(char servname[]);
+int reload_serv(char servname[]);
+int run_reload(char fname[], struct service *serv);
+int notify_read(struct service *serv);
+void reload_done(struct service *serv);
+void reload_reply(struct service *serv, int retval, char *why);
+void reload_read(struct service *serv);
+void reload_reaped(struct service *serv, int status);
+void reload_advance();
+int reload_timeout();
+int parse_signal(char *str);
+int run_command(unsigned char command, char servname[]);
+int command_mutates(unsigned char command);
+int run_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *out);
+void render_duration(struct outbuf *out, double seconds);
+void render_json_string(struct outbuf *out, char *str);
+int render_states(struct outbuf *out, unsigned char command, unsigned char flags, char servname[], struct servstate *states, int count);
+int compare_next_run(const void *a, const void *b);
+void render_serv(struct outbuf *out, struct servstate *serv, int flags, int oneline);
+void state_open();
+void state_publish(struct service *serv);
+int state_snapshot(struct statepage *page, struct servstate *states);
+struct statepage *state_map();
+int local_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *out);
+struct journal *journal_map(int writable);
+int journal_slot(struct journal *jnl, char servname[], int add);
+void journal_append(struct service *serv, int event, int32_t data);
+void log_feed(struct service *serv, char *data, size_t len);
+void log_flush(struct service *serv, int all);
+void log_prune(char servname[]);
+void log_read(struct service *serv);
+int log_timeout();
+int compare_segments(const void *a, const void *b);
+int log_segments(char servname[], int64_t *segs, int max);
+int log_index(char servname[], int64_t seg, struct logindex **idx, int *segfd);
+char *log_block(int segfd, struct logindex *idx);
+int log_print(FILE *out, char *block, int64_t since, int64_t until, regex_t *re);
+void log_tail(char servname[], int lines);
+time_t parse_time(char *str);
+int history(char servname[], time_t since);
+int read_servfile(char servname[], char key[], char *buf, size_t len);
+void load_servconf(char servname[], struct servconf *conf);
+int64_t mtime_of(char *path);
+int compare_names(const void *a, const void *b);
+int manifest_compile();
+uint32_t manifest_flags(char servname[]);
+int manifest_write(struct manifest *mf, size_t len);
+void manifest_update(char servname[]);
+int manifest_valid(struct manifest *mf, size_t len);
+int manifest_load(int compile);
+int compare_manifestent(const void *key, const void *ent);
+struct manifestent *manifest_find(char servname[]);
+void get_servconf(char servname[], struct servconf *conf);
+int compile();
+int psi_open();
+int shed_one();
+void restore_one();
+int psi_timeout();
+long parse_duration(char *str);
+int parse_calfield(char *field, int min, int max, uint64_t *mask);
+int parse_calendar(char *expr, struct schedule *sched);
+time_t next_calendar(struct schedule *sched, time_t after);
+time_t next_run(struct service *serv, time_t last);
+time_t last_run(char servname[]);
+void touch_last_run(char servname[]);
+void timer_push(struct service *serv);
+struct service *timer_pop();
+void timer_arm();
+void timers_load();
+void timers_fire();
+void activations_open();
+void activations_load();
+void activations_watch();
+void activations_check(char *uevent, size_t len);
+int uevent_matches(char *conds, char *uevent, size_t len);
+void activations_read(int fd);
 int rundaemon();
-void sigchld_handler(int signo);
+void reap_children();
 int daemon_send(unsigned char command, char servname[]);
+double monotime();
+void hist_observe(struct histogram *hist, double value);
+void bufprintf(struct outbuf *out, char *format, ...);
+void render_hist(struct outbuf *out, char *name, char *help, struct histogram *hist);
+void render_metrics(struct outbuf *out);
+int runtime_dir();
+int listen_unix(char *path, mode_t mode);
+int listen_tcp(int port);
+void accept_client(int listenfd, int kind);
+void close_client(int clientid);
+int read_client(int clientid);
+void serve_client(struct client *client);
+int write_client(int clientid);
+int write_all(int fd, char *buf, size_t len);
+int show_metrics();
+int daemon_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *reply);
+int query(unsigned char command, unsigned char flags, char servname[]);
 
 #include "config.h"
 
@@ -74,66 +230,515 @@ struct servlist {
     int servc;
 };
 
+#define SERV_STOPPED 0
+#define SERV_RUNNING 1
+#define SERV_DEAD    2
+
+#define SERV_SHED    3 /* stopped because of memory pressure */
+#define SERV_FROZEN  4 /* SIGSTOPped because of memory pressure */
+#define SERV_STATES  5
+
+#define SERV_ALIVE(serv) ((serv)->state == SERV_RUNNING || (serv)->state == SERV_FROZEN)
+
+static char *const servstates[] = { "stopped", "running", "dead", "shed", "frozen" };
+
+#define SHED_NONE   0
+#define SHED_STOP   1
+#define SHED_FREEZE 2
+
+#define CAL_MIN  0
+#define CAL_HOUR 1
+#define CAL_MDAY 2
+#define CAL_MON  3
+#define CAL_WDAY 4
+
+/* when a timer-activated service runs, see load_servconf() */
+struct schedule {
+    long interval; /* seconds between runs, 0 if none */
+    int calendar; /* set if fields is used */
+    uint64_t fields[5]; /* CAL_*, one bit per matching value */
+    long randomdelay; /* runs are delayed by up to this many seconds */
+    int catchup; /* make up for runs missed while we were down */
+};
+
+#define SCHEDULED(serv) ((serv)->conf.sched.interval || (serv)->conf.sched.calendar)
+
+/* per-service settings, see load_servconf() */
+struct servconf {
+    int priority;
+    int shed; /* SHED_* */
+    struct schedule sched;
+    int reloadsig; /* signal that makes it reload, 0 if it can't */
+    int notify; /* fd it reports readiness on, -1 if none */
+};
+
+#define MAXDEPENDS 32
+
+/* the output of a service waiting to be compressed, see log_feed() */
+struct logblock {
+    char *raw; /* lines, each prefixed with its time in milliseconds */
+    size_t len;
+    size_t cap;
+    int64_t first; /* time of the first and last line */
+    int64_t last;
+    double opened_at; /* monotime() of the first line */
+    int midline; /* the last line isn't complete yet */
+};
+
+/* a compressed block in a log segment */
+struct logindex {
+    int64_t first; /* unix time of the first and last line, in milliseconds */
+    int64_t last;
+    uint64_t offset; /* in the segment */
+    uint32_t size; /* compressed */
+    uint32_t rawsize;
+};
+
+/* more than this and the oldest ones aren't seen */
+#define LOGMAXSEGMENTS 1024
+
+#define PLAN_NONE    0
+#define PLAN_WAITING 1 /* for its dependencies */
+#define PLAN_STARTED 2 /* but not ready yet */
+
 struct service {
     char *name; /* name of service, for restarting */
     pid_t procid; /* same as /etc/kanrisha.d/available/<service>/pid */
+    int state; /* SERV_*. services stay in the table once started */
     int restart_when_dead; /* should we (still) restart? */
     int restart_times; /* how many times was the service restarted? used to prevent 100% cpu from instantly dying services */
     int exited_normally; /* set if retval = 0 || stopped by kanrisha stop */
+    int last_status; /* wait status of the last exit, -1 if it never exited */
+    time_t started_at; /* time of the last start, for uptime */
+    int slot; /* index in services and in the state page */
+    int jslot; /* index entry in the journal, -1 if none */
+    struct servconf conf;
+    time_t next_run; /* when the timer fires next, 0 if it isn't armed */
+    int notifyfd; /* read end of the readiness pipe, -1 if none */
+    int ready_pending; /* started, but hasn't reported ready yet */
+    double starting_at; /* monotime() of the last start */
+    double expected; /* moving average of the time-to-ready, -1 if unknown */
+    double last_ready; /* the last time-to-ready */
+    int planned; /* PLAN_*, see plan_start() */
+    double chain; /* see plan_chain(), -1 if not computed yet */
+    struct service *depends[MAXDEPENDS];
+    int depc;
+    int outfd; /* read end of the output pipe, -1 if none */
+    struct logblock log;
+    int64_t segment; /* start of the current log segment, 0 if none yet */
+    off_t segsize;
+    char *activate; /* the activate file, NULL if none */
+    int awaiting; /* for an activation condition to hold */
+    int stopping; /* got SIGTERM, but hasn't been reaped yet */
+    int stop_state; /* SERV_STOPPED or SERV_SHED, for once it has been */
+    double stop_at; /* monotime() of the SIGTERM */
+    double kill_at; /* when it gets SIGKILL, 0 once it got it */
+    int restart_pending; /* start it again once it has stopped */
+    double reload_at; /* monotime() of the last reload */
+    double reload_until; /* when a reload has to have reported ready, 0 if none is */
+    pid_t reload_pid; /* of the running reload executable, 0 if none is */
+    int reload_outfd; /* read end of its output pipe, -1 if none */
+    int reload_ready; /* reported ready while the reload executable still ran */
 };
 
 struct service **services;
 int service_count = 0;
 
+#define MAXWATCHES 256
+
+/* what activation conditions are watched with, see activations_load() */
+struct {
+    int inotifyfd;
+    int ueventfd;
+    int wds[MAXWATCHES];
+    int wdc;
+} activation = { .inotifyfd = -1, .ueventfd = -1 };
+
+/* the start plan of plan_start() */
+struct {
+    int active;
+    int count; /* services in it */
+    double started_at;
+    double ready_at; /* monotime() when the last one got done */
+    double predicted; /* makespan, from the expected time-to-ready */
+    double actual;
+} plan;
+
+/* the target start_all() starts, see isolate() */
+char current_target[256] = "default";
+
+/* monotime() of the last memory pressure event or restored service */
+double pressure_at = 0;
+
+/* scheduled services, see timer_push() */
+struct {
+    int fd;
+    int count;
+    struct service *heap[MAXSERVICES];
+} timers = { .fd = -1 };
+
+#define STATEMAGIC 0x6b6e7273
+
+/* a service as published in the state page. fixed layout, so that
+   other programs can read SHMSTATEPATH too */
+struct servstate {
+    char name[64];
+    int32_t pid; /* 0 unless running or frozen */
+    int32_t state; /* SERV_* */
+    int64_t started_at; /* unix time of the last start */
+    int32_t restarts;
+    int32_t last_status; /* wait status of the last exit, -1 if it never exited */
+    int64_t next_run; /* unix time of the next timer run, 0 if none */
+};
+
+/* readers wait for an even seq, copy what they need and retry if seq
+   changed meanwhile. the daemon makes seq odd while updating. */
+struct statepage {
+    atomic_uint magic; /* STATEMAGIC, set once the page is ready */
+    uint32_t size; /* sizeof(struct statepage), to catch layout changes */
+    atomic_uint seq;
+    uint32_t count; /* used entries in servs */
+    int32_t daemon_pid; /* to tell a stale page from a live one */
+    struct servstate servs[MAXSERVICES];
+};
+
+struct statepage *statepage;
+
+#define JOURNALMAGIC 0x6b6e726a
+
+#define JNL_START   0
+#define JNL_READY   1
+#define JNL_EXIT    2
+#define JNL_SIGNAL  3
+#define JNL_RESTART 4
+#define JNL_STOP    5
+#define JNL_SHED    6
+#define JNL_RESTORE 7
+#define JNL_RELOAD  8
+#define JNL_EVENTS  9
+
+static char *const journalevents[] = { "start", "ready", "exit", "signal", "restart", "stop", "shed", "restore", "reload" };
+
+struct journalrec {
+    uint64_t seq; /* position in the journal, 0 while being written */
+    int64_t time; /* unix time in milliseconds */
+    uint64_t prev; /* seq of the previous record of this service, 0 if none */
+    uint16_t serv; /* index entry of the service */
+    uint8_t event; /* JNL_* */
+    uint8_t pad;
+    int32_t data; /* pid, wait status or restart count, depending on event */
+};
+
+/* the journal is a ring of JOURNALRECORDS records behind an index
+   of the newest record of every service */
+struct journal {
+    uint32_t magic;
+    uint32_t size; /* size of the whole file */
+    uint64_t next; /* seq of the next record */
+    uint32_t nservs;
+    uint32_t pad;
+    struct {
+        char name[64];
+        uint64_t last; /* seq of the service's newest record */
+    } servs[MAXSERVICES];
+    struct journalrec recs[];
+};
+
+struct journal *journal;
+
+#define MANIFESTMAGIC 0x6b6e726d
+
+#define MF_ENABLED   0x01
+#define MF_RELOADCMD 0x02 /* has a reload executable */
+
+/* settings that are kept as they are, see get_servtext() */
+static char *const mftexts[] = { "depends", "activate" };
+#define MF_TEXTS 2
+
+/* a service in the manifest */
+struct manifestent {
+    uint32_t name; /* offset in the string table */
+    uint32_t flags; /* MF_* */
+    uint32_t texts[MF_TEXTS]; /* offsets of the mftexts files in the string table */
+    struct servconf conf;
+};
+
+/* the manifest is this header, the services sorted by name and a
+   string table. it is only valid as long as the directory mtimes in
+   it match, edits of settings are picked up by `kanrisha compile`
+   and by reloading the service */
+struct manifest {
+    uint32_t magic;
+    uint32_t size; /* sizeof(struct manifestent), to catch layout changes */
+    uint32_t count;
+    uint32_t strsize;
+    int64_t available_mtime;
+    int64_t enabled_mtime;
+    struct manifestent servs[];
+};
+
+#define MANIFEST_NAME(ent) ((char *)&manifest->servs[manifest->count] + (ent)->name)
+
+struct manifest *manifest;
+size_t manifest_len;
+
+/* upper bounds of the latency histogram buckets, in seconds */
+static const double histbounds[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30 };
+#define HISTBUCKETS (sizeof(histbounds) / sizeof(*histbounds))
+
+struct histogram {
+    unsigned long buckets[HISTBUCKETS + 1]; /* per bucket, not cumulative. the last one is +Inf */
+    unsigned long count;
+    double sum;
+};
+
+struct {
+    unsigned long starts; /* successful start_serv() calls */
+    unsigned long start_failures;
+    unsigned long restarts; /* restarts done by reap_children() */
+    unsigned long stops;
+    unsigned long sheds; /* services shed because of memory pressure */
+    unsigned long timer_runs; /* services started by their timer */
+    unsigned long reloads; /* successful reload_serv() calls */
+    unsigned long log_bytes; /* service output received */
+    unsigned long log_stored_bytes; /* and what it took in the archive */
+    unsigned long commands;
+    unsigned long exit_codes[256]; /* exits by return value */
+    unsigned long exit_signals[NSIG]; /* exits by terminating signal */
+    struct histogram start_latency;
+    struct histogram stop_latency;
+    struct histogram reload_latency;
+    struct histogram command_rtt;
+} metrics;
+
+struct outbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+#define CLIENT_METRICS 1
+#define CLIENT_CTL     2
+
+/* cmd fifo, metrics sockets, control socket, psi trigger, timerfd,
+   inotify fd and uevent socket */
+#define NLISTENFDS 9
+
+#define QUERY_JSON 0x01
+
+struct client {
+    int fd;
+    int kind;
+    size_t reqlen;
+    char req[512];
+    int replying; /* the request is served, out is being sent */
+    struct outbuf out;
+    size_t sent;
+    struct service *reloading; /* the reply waits for it to reload, see reload_reply() */
+};
+
+struct client clients[MAXCLIENTS];
+int client_count = 0;
+
+struct logrecord {
+    atomic_ulong seq; /* ring position this slot is free for, or holds a record of */
+    struct timespec time;
+    int priority;
+    char servname[64];
+    char message[LOGMSGLEN];
+};
+
+struct {
+    atomic_ulong tail; /* next position to claim */
+    atomic_ulong dropped; /* records lost because the ring was full */
+    atomic_ulong written;
+    atomic_int sleeping; /* set while log_writer() waits on wakefd */
+    int wakefd;
+    struct logrecord records[LOGRINGSIZE];
+} logring;
+
+int logging_async = 0;
+
 void malloc_fail() {
     perror("malloc");
     exit(-1);
 }
 
-void sys_perror(char *description) {
-    int error = errno;
+/**
+ * logs a message. before log_start(), it is written out right away.
+ * afterwards it is queued in logring and written out by log_writer(),
+ * so that a slow syslog never stalls supervision.
+**/
+void sys_log(int priority, char *servname, char *format, ...) {
+    struct timespec now;
+    va_list args;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (!logging_async) {
+        char message[LOGMSGLEN];
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        log_write(priority, &now, servname, message);
+        return;
+    }
+
+    /* claim a slot. logring is a bounded mpsc queue: a slot is free for
+       position pos when its seq is pos and holds a record when it is pos + 1. */
+    struct logrecord *record;
+    unsigned long pos = atomic_load_explicit(&logring.tail, memory_order_relaxed);
+    while (1) {
+        record = &logring.records[pos % LOGRINGSIZE];
+        unsigned long seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logring.tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* full */
+            atomic_fetch_add_explicit(&logring.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&logring.tail, memory_order_relaxed);
+        }
+    }
+
+    record->time = now;
+    record->priority = priority;
+    snprintf(record->servname, sizeof(record->servname), "%s", servname ? servname : "");
+    va_start(args, format);
+    vsnprintf(record->message, sizeof(record->message), format, args);
+    va_end(args);
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+
+    /* only wake the writer if it went to sleep */
+    if (atomic_exchange(&logring.sleeping, 0)) {
+        uint64_t one = 1;
+        write(logring.wakefd, &one, sizeof(one));
+    }
+}
+
+void log_write(int priority, struct timespec *time, char *servname, char *message) {
 #ifdef WRITE_TO_OUTPUT
-    fprintf(stderr, "%s: %s\n", description, strerror(error));
+    fputs(message, priority <= LOG_WARNING ? stderr : stdout);
 #endif
 #ifdef WRITE_TO_SYSLOG
-    syslog(LOG_DAEMON | LOG_ERR, "%s: %s\n", description, strerror(error));
+    syslog(LOG_DAEMON | priority, "%s", message);
+#endif
+#ifdef LOGFILEPATH
+    static FILE *logfile;
+    char stamp[32];
+    struct tm tm;
+    if (!logfile && !(logfile = fopen(LOGFILEPATH, "ae")))
+        return;
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&time->tv_sec, &tm));
+    fprintf(logfile, "%s.%03ld <%d> %s%s%s", stamp, time->tv_nsec / 1000000, priority,
+            servname ? servname : "", servname && *servname ? ": " : "", message);
+    fflush(logfile);
+#else
+    (void)time;
+    (void)servname;
 #endif
 }
 
+int log_start() {
+    pthread_t writer;
+
+    for (unsigned long pos = 0; pos < LOGRINGSIZE; pos++)
+        atomic_init(&logring.records[pos].seq, pos);
+
+    if ((logring.wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        sys_perror("log_start(): eventfd");
+        return -1;
+    }
+
+    /* the writer must not take signals meant for the main loop */
+    sigset_t set, oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    int error = pthread_create(&writer, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (error) {
+        errno = error;
+        sys_perror("log_start(): pthread_create");
+        return -1;
+    }
+
+    pthread_detach(writer);
+    logging_async = 1;
+    return 0;
+}
+
+/**
+ * drains logring in batches, flushing output once per batch.
+**/
+void *log_writer(void *arg) {
+    unsigned long pos = 0, reported = 0;
+    (void)arg;
+
+    while (1) {
+        int written = 0;
+        while (written < LOGBATCH) {
+            struct logrecord *record = &logring.records[pos % LOGRINGSIZE];
+            if (atomic_load_explicit(&record->seq, memory_order_acquire) != pos + 1)
+                break;
+
+            log_write(record->priority, &record->time, record->servname, record->message);
+            atomic_store_explicit(&record->seq, pos + LOGRINGSIZE, memory_order_release);
+            pos++;
+            written++;
+        }
+        atomic_fetch_add_explicit(&logring.written, written, memory_order_relaxed);
+
+        unsigned long dropped = atomic_load_explicit(&logring.dropped, memory_order_relaxed);
+        if (dropped != reported) {
+            char message[64];
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(message, sizeof(message), "warning: dropped %lu log messages\n", dropped - reported);
+            log_write(LOG_WARNING, &now, NULL, message);
+            reported = dropped;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        if (written == LOGBATCH)
+            continue;
+
+        /* go to sleep, unless something came in meanwhile */
+        atomic_store(&logring.sleeping, 1);
+        if (atomic_load_explicit(&logring.records[pos % LOGRINGSIZE].seq, memory_order_acquire) == pos + 1) {
+            atomic_store(&logring.sleeping, 0);
+            continue;
+        }
+        uint64_t count;
+        read(logring.wakefd, &count, sizeof(count));
+    }
+
+    return NULL;
+}
+
+void sys_perror(char *description) {
+    sys_log(LOG_ERR, NULL, "%s: %s\n", description, strerror(errno));
+}
+
 void sys_eprintf(char *format, char *servname) {
-#ifdef WRITE_TO_OUTPUT
-    fprintf(stderr, format, servname);
-#endif
-#ifdef WRITE_TO_SYSLOG
-    syslog(LOG_DAEMON | LOG_ERR, format, servname);
-#endif
+    sys_log(LOG_ERR, servname, format, servname);
 }
 
 void sys_wprintf(char *format, char *servname) {
-#ifdef WRITE_TO_OUTPUT
-    fprintf(stderr, format, servname);
-#endif
-#ifdef WRITE_TO_SYSLOG
-    syslog(LOG_DAEMON | LOG_WARNING, format, servname);
-#endif
+    sys_log(LOG_WARNING, servname, format, servname);
 }
 
 void sys_iprintf(char *format, char *servname) {
-#ifdef WRITE_TO_OUTPUT
-    printf(format, servname);
-#endif
-#ifdef WRITE_TO_SYSLOG
-    syslog(LOG_DAEMON | LOG_NOTICE, format, servname);
-#endif
+    sys_log(LOG_NOTICE, servname, format, servname);
 }
 
 void sys_cprintf(char *format, unsigned char command, int retval) {
-#ifdef WRITE_TO_OUTPUT
-    printf(format, command, retval);
-#endif
-#ifdef WRITE_TO_SYSLOG
-    syslog(LOG_DAEMON | LOG_INFO, format, command, retval);
-#endif
+    sys_log(LOG_INFO, NULL, format, command, retval);
 }
 
 void help() {
@@ -141,20 +746,65 @@ void help() {
            "           created for the ichirou init system\n\n"
            "kanrisha list - list all available services\n"
            "kanrisha list enabled - list enabled services\n"
-           "kanrisha list running - list running services\n"
-           "kanrisha log service - show latest log of service\n"
-           "kanrisha status service - show status of service\n"
+           "kanrisha list running [--json] - list running services\n"
+           "kanrisha list timers [--json] - list timer-activated services by next run\n"
+           "kanrisha log service [--since time] [--until time] [--grep pattern] - show log of service\n"
+           "kanrisha status [--all] [--json] - show status of all services\n"
+           "kanrisha status service [--json] - show status of service\n"
            "kanrisha enable service - enable service\n"
            "kanrisha disable service - disable service\n"
            "kanrisha start - start all enabled services\n"
            "kanrisha start service - start service\n"
            "kanrisha stop - stop all running services\n"
            "kanrisha restart service - restart service\n"
+           "kanrisha reload service - reload configuration of service\n"
+           "kanrisha isolate target - switch to the services of target\n"
+           "kanrisha history service [--since time] - show start/stop history of service\n"
+           "kanrisha metrics - print daemon metrics\n"
+           "kanrisha compile - rebuild the service manifest\n"
+           "kanrisha timings - show how long services take to get ready\n"
            "kanrisha daemon - run main daemon in background\n");
 }
 
+struct servlist get_available_servs() {
+    struct servlist servslist;
+    servslist.servc = 0;
+
+    if (manifest) {
+        for (uint32_t i = 0; i < manifest->count && servslist.servc < MAXSERVICES; i++)
+            strcpy(servslist.services[servslist.servc++], MANIFEST_NAME(&manifest->servs[i]));
+        return servslist;
+    }
+
+    struct dirent* dent;
+    DIR* srcdir = opendir("/etc/kanrisha.d/available/");
+    if (srcdir == NULL) {
+        sys_perror("get_available_servs(): opendir");
+        return servslist;
+    }
+
+    while ((dent = readdir(srcdir)) != NULL && servslist.servc < MAXSERVICES) {
+        struct stat st;
+
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+            continue;
+
+        if (fstatat(dirfd(srcdir), dent->d_name, &st, 0) < 0) {
+            sys_perror("get_available_servs(): fstatat");
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            strcpy(servslist.services[servslist.servc++], dent->d_name);
+        }
+    }
+    closedir(srcdir);
+    return servslist;
+}
+
 struct servlist get_running_servs() {
     struct servlist servslist;
+    servslist.servc = 0;
 
     struct dirent* dent;
     DIR* srcdir = opendir("/etc/kanrisha.d/available/");
@@ -193,23 +843,51 @@ struct servlist get_running_servs() {
 }
 
 struct servlist get_enabled_servs() {
+    struct servlist servslist = get_target_servs("default");
+    if (servslist.servc < 0)
+        exit(1);
+    return servslist;
+}
+
+/**
+ * lists the services of a target. the default target is the enabled
+ * directory, the others live in /etc/kanrisha.d/targets. servc is -1
+ * if the target doesn't exist.
+**/
+struct servlist get_target_servs(char target[]) {
     struct servlist servslist;
+    servslist.servc = 0;
+
+    if (manifest && !strcmp(target, "default")) {
+        for (uint32_t i = 0; i < manifest->count && servslist.servc < MAXSERVICES; i++) {
+            if (manifest->servs[i].flags & MF_ENABLED)
+                strcpy(servslist.services[servslist.servc++], MANIFEST_NAME(&manifest->servs[i]));
+        }
+        return servslist;
+    }
+
+    char dirname[300];
+    if (!strcmp(target, "default"))
+        snprintf(dirname, sizeof(dirname), "/etc/kanrisha.d/enabled/");
+    else
+        snprintf(dirname, sizeof(dirname), "/etc/kanrisha.d/targets/%s/", target);
 
     struct dirent* dent;
-    DIR* srcdir = opendir("/etc/kanrisha.d/enabled/");
+    DIR* srcdir = opendir(dirname);
     if (srcdir == NULL) {
-        perror("get_enabled_servs(): opendir");
-        exit(1);
+        sys_perror("get_target_servs(): opendir");
+        servslist.servc = -1;
+        return servslist;
     }
 
-    while ((dent = readdir(srcdir)) != NULL) {
+    while ((dent = readdir(srcdir)) != NULL && servslist.servc < MAXSERVICES) {
         struct stat st;
 
         if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
             continue;
 
         if (fstatat(dirfd(srcdir), dent->d_name, &st, 0) < 0) {
-            perror("get_enabled_servs(): fstatat");
+            sys_perror("get_target_servs(): fstatat");
             continue;
         }
 
@@ -222,6 +900,8 @@ struct servlist get_enabled_servs() {
 }
 
 int list(int only_enabled, int only_running) {
+    manifest_load(1);
+
     if (only_enabled) {
         struct servlist enabledservs = get_enabled_servs();
         for (int servid = 0; servid < enabledservs.servc; servid++) {
@@ -232,6 +912,9 @@ int list(int only_enabled, int only_running) {
         for (int servid = 0; servid < runningservs.servc; servid++) {
             printf("%s\n", runningservs.services[servid]);
         }
+    } else if (manifest) {
+        for (uint32_t i = 0; i < manifest->count; i++)
+            printf("%s\n", MANIFEST_NAME(&manifest->servs[i]));
     } else {
         struct dirent* dent;
         DIR* srcdir = opendir("/etc/kanrisha.d/available/");
@@ -260,21 +943,6 @@ int list(int only_enabled, int only_running) {
     return 0;
 }
 
-int showlog(char servname[]) {
-    char* logfname;
-    if (!(logfname = malloc(sizeof(char) * (32 + strlen(servname))))) malloc_fail();
-
-    strcpy(logfname, "/etc/kanrisha.d/available/");
-    strcat(logfname, servname);
-    strcat(logfname, "/log");
-
-    char* fullcmd[] = { "less", logfname, NULL };
-
-    execvp(fullcmd[0], fullcmd);
-
-    perror("execvp");
-    return 1;
-}
 
 int status(char servname[]) {
     /**
@@ -294,15 +962,28 @@ int status(char servname[]) {
     **/
 
     char* pidfname;
-    char* logfname;
     if (!(pidfname = malloc(sizeof(char) * (32 + strlen(servname))))) malloc_fail();
-    if (!(logfname = malloc(sizeof(char) * (32 + strlen(servname))))) malloc_fail();
 
     strcpy(pidfname, "/etc/kanrisha.d/available/");
     strcat(pidfname, servname);
-    strcpy(logfname, pidfname);
     strcat(pidfname, "/pid");
-    strcat(logfname, "/log");
+
+    /* ask the daemon first, it knows better than the pidfile */
+    struct outbuf reply = { 0 };
+    int retval = local_query(0x2D, 0, servname, &reply);
+    if (retval == -3)
+        retval = daemon_query(0x2D, 0, servname, &reply);
+    if (retval >= 0) {
+        fwrite(reply.data, 1, reply.len, retval ? stderr : stdout);
+        fflush(stdout);
+        free(reply.data);
+        if (retval)
+            return retval;
+
+        putchar('\n');
+        log_tail(servname, STATUSLOGLEN);
+        return 0;
+    }
 
     char status[12] = "not running";
     pid_t pid = -1;
@@ -329,14 +1010,7 @@ int status(char servname[]) {
            "main pid: %d\n\n",
            servname, status, pid);
 
-    /* printing the last lines of a file in C is a fucking nightmare when
-       you care about compact, fast and beautiful code. we'll just execvp
-       tail to deal with this absolutely hellish fuckery */
-
-    char* fullcmd[] = { "tail", "-n", STATUSLOGLEN, logfname, NULL };
-    execvp(fullcmd[0], fullcmd);
-
-    perror("execvp");
+    log_tail(servname, STATUSLOGLEN);
 
     return 0;
 }
@@ -398,8 +1072,39 @@ int disable_serv(char servname[]) {
     return 0;
 }
 
+struct service *find_serv(char servname[]) {
+    for (int i = 0; i < service_count; i++) {
+        if (!strcmp(services[i]->name, servname))
+            return services[i];
+    }
+    return NULL;
+}
+
+struct service *add_serv(char servname[]) {
+    if (service_count == MAXSERVICES)
+        return NULL;
+
+    struct service *serv;
+    if (!(serv = calloc(1, sizeof(struct service)))) malloc_fail();
+    serv->name = strdup(servname);
+    serv->state = SERV_STOPPED;
+    serv->last_status = -1;
+    serv->slot = service_count;
+    serv->jslot = journal ? journal_slot(journal, servname, 1) : -1;
+    serv->notifyfd = -1;
+    serv->outfd = -1;
+    serv->reload_outfd = -1;
+    serv->expected = -1;
+    get_servconf(servname, &serv->conf);
+    services[service_count++] = serv;
+
+    state_publish(serv);
+    return serv;
+}
+
 int start_serv(char servname[]) {
     sys_iprintf("starting service %s...\n", servname);
+    double started_at = monotime();
 
     char* fname;
     char* pidfname;
@@ -410,50 +1115,108 @@ int start_serv(char servname[]) {
 
     snprintf(fname, 32 + strlen(servname), "/etc/kanrisha.d/available/%s/run", servname);
     snprintf(pidfname, 32 + strlen(servname), "/etc/kanrisha.d/available/%s/pid", servname);
-    snprintf(logfname, 32 + strlen(servname), "/etc/kanrisha.d/available/%s/run", servname);
+    snprintf(logfname, 32 + strlen(servname), "/etc/kanrisha.d/available/%s/log", servname);
 
-    for (int i = 0; i < service_count; i++) {
-        if (!strcmp(services[i]->name, servname)) {
+    struct service *started_serv = find_serv(servname);
+    if ((started_serv && SERV_ALIVE(started_serv)) || (!started_serv && service_count == MAXSERVICES)) {
+        if (started_serv)
             sys_eprintf("error: %s is already running\n", servname);
-            free(fname);
-            free(pidfname);
-            free(logfname);
-            return 1;
-        }
+        else
+            sys_eprintf("error: too many services to start %s\n", servname);
+        metrics.start_failures++;
+        free(fname);
+        free(pidfname);
+        free(logfname);
+        return 1;
     }
 
     if (access(fname, F_OK|X_OK) != -1) {
         if (access(fname, F_OK|W_OK) != -1) {
+            /* the service tells us when it's ready through this pipe */
+            struct servconf conf;
+            int notify[2] = { -1, -1 };
+            get_servconf(servname, &conf);
+            if (conf.notify >= 0 && pipe2(notify, O_CLOEXEC) != 0) {
+                sys_perror("start_serv(): pipe2");
+                notify[0] = notify[1] = -1;
+            }
+
+            /* and its output goes to the log archive through this one */
+            int output[2] = { -1, -1 };
+            if (pipe2(output, O_CLOEXEC) != 0) {
+                sys_perror("start_serv(): pipe2");
+                output[0] = output[1] = -1;
+            }
+
             pid_t child_pid = fork();
             if (child_pid == 0) {
                 char *const args[] = { "--run-by-kanrisha", "true", NULL };
 
+                /* the log writer thread didn't survive the fork */
+                logging_async = 0;
+                /* the daemon keeps SIGCHLD blocked for its signalfd */
+                sigset_t set;
+                sigemptyset(&set);
+                sigprocmask(SIG_SETMASK, &set, NULL);
+                signal(SIGPIPE, SIG_DFL);
+
                 int fd;
-                if ((fd = open(logfname, O_CREAT | O_WRONLY | O_TRUNC, LOGFILEPERMS)) < 0){
+                if (output[1] >= 0) {
+                    dup2(output[1], 1);
+                } else if ((fd = open(logfname, O_CREAT | O_WRONLY | O_TRUNC, LOGFILEPERMS)) >= 0) {
+                    dup2(fd, 1);
+                    close(fd);
+                } else {
                     sys_perror("start_serv(): open");
-                    free(fname);
-                    free(pidfname);
-                    free(logfname);
-                    return -1;
+                    _exit(-1);
                 }
 
-                dup2(fd, 1);
-                close(fd);
+                if (notify[1] == conf.notify)
+                    fcntl(notify[1], F_SETFD, 0);
+                else if (notify[1] >= 0)
+                    dup2(notify[1], conf.notify);
 
                 execvp(fname, args);
-                sleep(3);
-                stop_serv(servname);
-                exit(-1);
+                sys_perror("start_serv(): execvp");
+                _exit(-1);
             } else {
                 /* save service data internally */
-                struct service *started_serv = malloc(sizeof(struct service));
-                started_serv->name = strdup(servname);
+                if (!started_serv)
+                    started_serv = add_serv(servname);
+                else
+                    get_servconf(servname, &started_serv->conf);
                 started_serv->procid = child_pid;
-                started_serv->restart_when_dead = 1;
+                started_serv->state = SERV_RUNNING;
+                /* timer runs are one-shot */
+                started_serv->restart_when_dead = !SCHEDULED(started_serv);
                 started_serv->restart_times = 0;
                 started_serv->exited_normally = 0;
+                if (started_serv->reload_until)
+                    reload_reply(started_serv, 1, "was restarted before it reloaded");
+                started_serv->started_at = time(NULL);
+                started_serv->starting_at = started_at;
+                if (started_serv->notifyfd >= 0)
+                    close(started_serv->notifyfd);
+                started_serv->notifyfd = notify[0];
+                started_serv->ready_pending = notify[0] >= 0;
+                if (notify[0] >= 0) {
+                    close(notify[1]);
+                    fcntl(notify[0], F_SETFL, O_NONBLOCK);
+                }
+                /* whatever is left of the last run's output first */
+                if (started_serv->outfd >= 0) {
+                    fcntl(started_serv->outfd, F_SETFL, O_NONBLOCK);
+                    log_read(started_serv);
+                    if (started_serv->outfd >= 0)
+                        close(started_serv->outfd);
+                }
+                started_serv->outfd = output[0];
+                if (output[0] >= 0) {
+                    close(output[1]);
+                    fcntl(output[0], F_SETFL, O_NONBLOCK);
+                }
 
-                services[service_count++] = started_serv;
+                state_publish(started_serv);
 
                 /* save pidfile on disk */
                 FILE *fp;
@@ -463,6 +1226,7 @@ int start_serv(char servname[]) {
             }
         } else {
             sys_eprintf("error: missing permissions\n", NULL);
+            metrics.start_failures++;
             free(fname);
             free(pidfname);
             free(logfname);
@@ -470,12 +1234,19 @@ int start_serv(char servname[]) {
         }
     } else {
         sys_eprintf("error: %s doesn't exist\n", servname);
+        metrics.start_failures++;
         free(fname);
         free(pidfname);
         free(logfname);
         return 1;
     }
+    journal_append(started_serv, JNL_START, started_serv->procid);
+    /* services that don't notify are ready once they run */
+    if (!started_serv->ready_pending)
+        serv_ready(started_serv);
     sys_iprintf("service %s has been started\n", servname);
+    metrics.starts++;
+    hist_observe(&metrics.start_latency, monotime() - started_at);
 
     free(fname);
     free(logfname);
@@ -484,270 +1255,3696 @@ int start_serv(char servname[]) {
     return 0;
 }
 
-int start_all() {
-    struct servlist servs = get_enabled_servs();
-    int retval = 0;
-    for (int i = 0; i < servs.servc; i++) {
-        retval += start_serv(servs.services[i]);
+/**
+ * reads a setting of servname that is one of mftexts into buf, like
+ * read_servfile() but from the manifest if servname is in it. buf is
+ * empty if there is no such setting.
+**/
+void get_servtext(char servname[], char key[], char *buf, size_t len) {
+    struct manifestent *ent = manifest_find(servname);
+
+    for (int i = 0; ent && i < MF_TEXTS; i++) {
+        if (!strcmp(mftexts[i], key)) {
+            snprintf(buf, len, "%s", (char *)&manifest->servs[manifest->count] + ent->texts[i]);
+            return;
+        }
     }
-    return retval;
+    if (read_servfile(servname, key, buf, len) != 0)
+        *buf = '\0';
 }
 
-int stop_serv(char servname[]) {
-    sys_iprintf("stopping service %s...\n", servname);
+/**
+ * returns how long nothing can start after serv does because of
+ * it: its own time-to-ready plus that of the longest chain of
+ * waiting services depending on it.
+**/
+double plan_chain(struct service *serv) {
+    if (serv->chain >= 0)
+        return serv->chain;
 
-    char* fname;
-    if (!(fname = malloc(sizeof(char) * (32 + strlen(servname))))) malloc_fail();
-    snprintf(fname, 32 + strlen(servname), "/etc/kanrisha.d/available/%s/pid", servname);
+    /* a cycle, plan_advance() breaks those */
+    serv->chain = 0;
 
-    int running = 0, i;
-    for (i = 0; i < service_count; i++) {
-        if (!strcmp(services[i]->name, servname)) {
-            running = 1;
-            break;
+    double longest = 0;
+    for (int i = 0; i < service_count; i++) {
+        struct service *other = services[i];
+        if (other->planned != PLAN_WAITING)
+            continue;
+        for (int j = 0; j < other->depc; j++) {
+            if (other->depends[j] == serv && plan_chain(other) > longest)
+                longest = other->chain;
         }
     }
+    serv->chain = (serv->expected > 0 ? serv->expected : 0) + longest;
+    return serv->chain;
+}
 
-    if (running) {
-        /* is this even running?? */
-        int needtokillproc = 1;
-        if (kill(services[i]->procid, SIGTERM) != 0) {
-            if (errno == ESRCH) {
-                needtokillproc = 0;
-            } else {
-                sys_perror("stop_serv(): kill");
-                free(fname);
-                return 1;
-            }
-        }
+/**
+ * adds the services of servs that aren't running to the start plan,
+ * along with the dependencies they need that aren't running either,
+ * and sets the plan going. a plan that is already going just gets
+ * longer. predicts the makespan from the time-to-ready of earlier
+ * boots.
+**/
+void plan_start(struct servlist *servs) {
+    char buf[1024], fname[320];
+    char *line, *saveptr;
+    char resolved[MAXSERVICES] = { 0 };
+    int added = 0, more;
 
-        /* kil, process */
-        for (int i = 0; i < SIGKILLTIMEOUT; i++) {
-            if (kill(services[i]->procid, SIGTERM) != 0) {
-                if (errno == ESRCH) {
-                    needtokillproc = 0;
-                    break;
-                } else {
-                    sys_perror("stop_serv(): kill");
-                    free(fname);
-                    return 1;
+    for (int i = 0; i < servs->servc; i++) {
+        struct service *serv = find_serv(servs->services[i]);
+        if (!serv && !(serv = add_serv(servs->services[i])))
+            continue;
+        /* these are started by their timer or activation condition */
+        get_servtext(serv->name, "activate", buf, sizeof(buf));
+        if (SCHEDULED(serv) || *buf || SERV_ALIVE(serv) || serv->planned != PLAN_NONE)
+            continue;
+        serv->planned = PLAN_WAITING;
+        added++;
+    }
+
+    /* dependencies join the plan too, so nothing starts before them */
+    do {
+        more = 0;
+        for (int i = 0; i < service_count; i++) {
+            struct service *serv = services[i];
+            if (serv->planned != PLAN_WAITING || resolved[i])
+                continue;
+            resolved[i] = 1;
+
+            serv->depc = 0;
+            get_servtext(serv->name, "depends", buf, sizeof(buf));
+            for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+                struct service *dep = find_serv(line);
+                snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s", line);
+                if (!dep && access(fname, F_OK) == 0)
+                    dep = add_serv(line);
+                if (!dep || dep == serv || serv->depc == MAXDEPENDS) {
+                    sys_wprintf("warning: ignoring a dependency of %s\n", serv->name);
+                    continue;
                 }
-            }
-        }
-        if (needtokillproc) {
-            sys_iprintf("service %s won't terminate, killing it\n", servname);
-            if (kill(services[i]->procid, SIGKILL) != 0) {
-                if (errno == EPERM) {
-                    sys_perror("stop_serv(): kill");
-                    free(fname);
-                    return 1;
+                serv->depends[serv->depc++] = dep;
+                if (dep->planned == PLAN_NONE && !SERV_ALIVE(dep)) {
+                    dep->planned = PLAN_WAITING;
+                    added++;
+                    more = 1;
                 }
             }
         }
+    } while (more);
 
-        /* delete pidfile */
-        if (unlink(fname) != 0) {
-            sys_wprintf("warning: cannot delete pidfile. please remove it manually or problems will occur ( %s )\n", strerror(errno));
-            free(fname);
-            return 1;
-        }
-    } else {
-        sys_eprintf("error: %s isn't running\n", servname);
-        free(fname);
-        return 1;
+    if (!plan.active) {
+        plan.count = 0;
+        plan.started_at = plan.ready_at = monotime();
     }
-    sys_iprintf("service %s has been stopped\n", servname);
+    plan.count += added;
 
-    free(fname);
+    for (int i = 0; i < service_count; i++)
+        services[i]->chain = -1;
+    double predicted = 0;
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->planned == PLAN_WAITING && plan_chain(services[i]) > predicted)
+            predicted = services[i]->chain;
+    }
+    /* what is still waiting starts from now on */
+    if (plan.active)
+        predicted += monotime() - plan.started_at;
+    if (!plan.active || predicted > plan.predicted)
+        plan.predicted = predicted;
 
-    return 0;
+    plan.active = 1;
+    sys_log(LOG_NOTICE, NULL, "starting %d services, predicted to take %.2fs\n", added, predicted);
+    plan_advance();
 }
 
-int stop_all() {
-    struct servlist servs = get_running_servs();
+/**
+ * starts the services of the current target in dependency order.
+ * only the ones with nothing left to wait for are started here,
+ * plan_advance() starts the others as their dependencies get ready.
+**/
+int start_all() {
+    if (plan.active) {
+        sys_eprintf("error: already starting all services\n", NULL);
+        return 1;
+    }
+
+    struct servlist servs = get_target_servs(current_target);
+    plan_start(&servs);
+
+    /* activated services stopped since are waiting again */
+    activations_load();
+
+    return 0;
+}
+
+/**
+ * moves the start plan along: services that got ready (or died, or
+ * never reported ready within READYTIMEOUT) are done, and of the
+ * services whose dependencies are all done, the ones with the longest
+ * chain behind them are started first, STARTJOBS at a time. services
+ * with a dependency that failed to start or died are dropped from
+ * the plan. called from the event loop whenever something might
+ * have changed.
+**/
+void plan_advance() {
+    struct service *next;
+    int starting, waiting, changed;
+
+    if (!plan.active)
+        return;
+
+    do {
+        next = NULL;
+        starting = waiting = changed = 0;
+
+        for (int i = 0; i < service_count; i++) {
+            struct service *serv = services[i];
+
+            if (serv->planned == PLAN_STARTED) {
+                if (serv->ready_pending && SERV_ALIVE(serv) && monotime() - serv->starting_at < READYTIMEOUT) {
+                    starting++;
+                    continue;
+                }
+                if (serv->ready_pending && SERV_ALIVE(serv))
+                    sys_wprintf("warning: %s didn't report ready in time, not waiting for it\n", serv->name);
+                serv->planned = PLAN_NONE;
+                plan.ready_at = monotime();
+            }
+        }
+
+        for (int i = 0; i < service_count; i++) {
+            struct service *serv = services[i];
+            if (serv->planned != PLAN_WAITING)
+                continue;
+            waiting++;
+
+            int blocked = 0, failed = 0;
+            for (int j = 0; j < serv->depc && !blocked && !failed; j++) {
+                struct service *dep = serv->depends[j];
+                blocked = dep->planned != PLAN_NONE;
+                /* done, but not running, and not because it finished */
+                failed = !blocked && !SERV_ALIVE(dep) && !(dep->state == SERV_DEAD && dep->exited_normally);
+            }
+            if (failed) {
+                sys_wprintf("warning: a dependency of %s failed, not starting it\n", serv->name);
+                serv->planned = PLAN_NONE;
+                waiting--;
+                changed = 1;
+            } else if (!blocked && (!next || serv->chain > next->chain)) {
+                next = serv;
+            }
+        }
+
+        if (!next && waiting && !starting && !changed) {
+            for (int i = 0; i < service_count; i++) {
+                if (services[i]->planned == PLAN_WAITING && (!next || services[i]->chain > next->chain))
+                    next = services[i];
+            }
+            sys_wprintf("warning: dependency cycle, starting %s anyway\n", next->name);
+        }
+
+        if (next && starting < STARTJOBS) {
+            next->planned = PLAN_STARTED;
+            if (start_serv(next->name) != 0)
+                next->planned = PLAN_NONE;
+        } else {
+            next = NULL;
+        }
+    } while (next || changed);
+
+    if (!waiting && !starting) {
+        plan.active = 0;
+        plan.actual = plan.ready_at - plan.started_at;
+        sys_log(LOG_NOTICE, NULL, "started %d services in %.2fs, predicted %.2fs\n",
+                plan.count, plan.actual, plan.predicted);
+        timings_save();
+    }
+}
+
+/**
+ * returns how long the event loop may sleep before a service
+ * of the start plan runs out of time to report ready, in
+ * milliseconds, or -1 for forever.
+**/
+int plan_timeout() {
+    double first = -1;
+
+    if (!plan.active)
+        return -1;
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->planned == PLAN_STARTED && services[i]->ready_pending
+            && (first < 0 || services[i]->starting_at < first))
+            first = services[i]->starting_at;
+    }
+    if (first < 0)
+        return -1;
+
+    double wait = first + READYTIMEOUT - monotime();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+/**
+ * marks serv ready and learns how long that took, as a moving
+ * average that follows the service as it gets faster or slower.
+**/
+void serv_ready(struct service *serv) {
+    double took = monotime() - serv->starting_at;
+
+    serv->ready_pending = 0;
+    journal_append(serv, JNL_READY, 0);
+
+    serv->last_ready = took;
+    if (serv->expected < 0)
+        serv->expected = took;
+    else
+        serv->expected = TIMINGWEIGHT * took + (1 - TIMINGWEIGHT) * serv->expected;
+}
+
+/**
+ * the timings file has the makespan of the last start plan in
+ * its first line and the time-to-ready of a service in every
+ * other line: the moving average and the last one, in seconds.
+**/
+void timings_load() {
+    char line[512], servname[256];
+    double expected, last;
+
+    FILE *fp = fopen(TIMINGSPATH, "re");
+    if (!fp)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %lf %lf", servname, &expected, &last) != 3 || !strcmp(servname, "makespan"))
+            continue;
+
+        /* services that are gone are forgotten with the next save */
+        struct service *serv = find_serv(servname);
+        if (!serv)
+            continue;
+        serv->expected = expected;
+        serv->last_ready = last;
+    }
+    fclose(fp);
+}
+
+void timings_save() {
+    char fname[sizeof(TIMINGSPATH) + 4];
+
+    snprintf(fname, sizeof(fname), "%s.new", TIMINGSPATH);
+    FILE *fp = fopen(fname, "we");
+    if (!fp) {
+        sys_perror("timings_save(): fopen");
+        return;
+    }
+    fprintf(fp, "makespan %.3f %.3f\n", plan.predicted, plan.actual);
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->expected >= 0)
+            fprintf(fp, "%s %.3f %.3f\n", services[i]->name, services[i]->expected, services[i]->last_ready);
+    }
+    if (fclose(fp) != 0 || rename(fname, TIMINGSPATH) != 0) {
+        sys_perror("timings_save()");
+        unlink(fname);
+    }
+}
+
+/**
+ * shows the learned time-to-ready of every service, slowest
+ * first, and how the last start plan compared to its prediction.
+**/
+int timings() {
+    struct timing { char name[256]; double expected, last; } *entries;
+    char line[512];
+    double predicted = -1, actual = -1;
+    int count = 0;
+
+    FILE *fp = fopen(TIMINGSPATH, "re");
+    if (!fp) {
+        fprintf(stderr, "error: no timings yet\n");
+        return 1;
+    }
+    if (!(entries = malloc(MAXSERVICES * sizeof(struct timing)))) malloc_fail();
+    while (fgets(line, sizeof(line), fp) && count < MAXSERVICES) {
+        struct timing *t = &entries[count];
+        if (sscanf(line, "%255s %lf %lf", t->name, &t->expected, &t->last) != 3)
+            continue;
+        if (!strcmp(t->name, "makespan")) {
+            predicted = t->expected;
+            actual = t->last;
+        } else {
+            count++;
+        }
+    }
+    fclose(fp);
+
+    /* slowest first */
+    for (int i = 1; i < count; i++) {
+        struct timing t = entries[i];
+        int j = i;
+        for (; j > 0 && entries[j - 1].expected < t.expected; j--)
+            entries[j] = entries[j - 1];
+        entries[j] = t;
+    }
+
+    printf("%-24s %10s %10s\n", "SERVICE", "EXPECTED", "LAST");
+    for (int i = 0; i < count; i++)
+        printf("%-24s %9.3fs %9.3fs\n", entries[i].name, entries[i].expected, entries[i].last);
+    if (predicted >= 0)
+        printf("\nlast start: predicted %.3fs, took %.3fs\n", predicted, actual);
+    free(entries);
+
+    return 0;
+}
+
+int stop_serv(char servname[]) {
+    struct service *stopped_serv = find_serv(servname);
+
+    if (!stopped_serv || stopped_serv->state == SERV_STOPPED) {
+        sys_eprintf("error: %s isn't running\n", servname);
+        return 1;
+    }
+
+    return stop_servs(&stopped_serv, 1);
+}
+
+/**
+ * stops count services at once. they all get SIGTERM right away,
+ * and SIGKILL from stop_advance() if they are still around
+ * SIGKILLTIMEOUT seconds later. they are stopped once reaped, see
+ * stop_done(). returns the number of failures.
+**/
+int stop_servs(struct service **servs, int count) {
     int retval = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct service *serv = servs[i];
+        if (serv->stopping)
+            continue;
+        sys_iprintf("stopping service %s...\n", serv->name);
+
+        /* don't let reap_children() bring it back up */
+        serv->restart_when_dead = 0;
+        serv->exited_normally = 1;
+        serv->stop_at = monotime();
+
+        /* is this even running?? */
+        serv->stop_state = SERV_STOPPED;
+        if (!SERV_ALIVE(serv)) {
+            stop_done(serv);
+            continue;
+        }
+        if (kill(serv->procid, SIGTERM) != 0 && errno != ESRCH) {
+            sys_perror("stop_servs(): kill");
+            retval++;
+            continue;
+        }
+        if (serv->state == SERV_FROZEN) {
+            /* it can't handle SIGTERM while stopped */
+            kill(serv->procid, SIGCONT);
+            serv->state = SERV_RUNNING;
+        }
+        serv->stopping = 1;
+        serv->kill_at = serv->stop_at + SIGKILLTIMEOUT;
+    }
+
+    return retval;
+}
+
+/**
+ * finishes stopping serv, once it's gone.
+**/
+void stop_done(struct service *serv) {
+    char* fname;
+
+    serv->state = serv->stop_state;
+    serv->stopping = 0;
+    serv->kill_at = 0;
+    state_publish(serv);
+    journal_append(serv, JNL_STOP, 0);
+    if (serv->state == SERV_SHED) {
+        journal_append(serv, JNL_SHED, serv->conf.shed);
+        metrics.sheds++;
+    }
+
+    /* delete pidfile */
+    if (!(fname = malloc(sizeof(char) * (32 + strlen(serv->name))))) malloc_fail();
+    snprintf(fname, 32 + strlen(serv->name), "/etc/kanrisha.d/available/%s/pid", serv->name);
+    if (unlink(fname) != 0 && errno != ENOENT) {
+        sys_perror("stop_done(): unlink");
+        sys_wprintf("warning: cannot delete pidfile of %s. please remove it manually or problems will occur\n", serv->name);
+    }
+    free(fname);
+
+    sys_iprintf("service %s has been stopped\n", serv->name);
+    metrics.stops++;
+    hist_observe(&metrics.stop_latency, monotime() - serv->stop_at);
+
+    if (serv->restart_pending) {
+        serv->restart_pending = 0;
+        if (start_serv(serv->name) == 0)
+            sys_iprintf("service %s has been restarted\n", serv->name);
+    }
+}
+
+/**
+ * sends SIGKILL to the services that had SIGKILLTIMEOUT
+ * seconds to stop and are still there. called from the
+ * event loop, like plan_advance().
+**/
+void stop_advance() {
+    double now = monotime();
+
+    for (int i = 0; i < service_count; i++) {
+        struct service *serv = services[i];
+        if (!serv->stopping || !serv->kill_at || now < serv->kill_at)
+            continue;
+
+        sys_iprintf("service %s won't terminate, killing it\n", serv->name);
+        serv->kill_at = 0;
+        if (kill(serv->procid, SIGKILL) != 0 && errno == EPERM) {
+            sys_perror("stop_advance(): kill");
+            serv->stopping = 0;
+            serv->restart_pending = 0;
+        }
+    }
+}
+
+/**
+ * returns how long the event loop may sleep before stop_advance()
+ * has something to do, in milliseconds, or -1 for forever.
+**/
+int stop_timeout() {
+    double next = 0;
+
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->stopping && services[i]->kill_at && (!next || services[i]->kill_at < next))
+            next = services[i]->kill_at;
+    }
+    if (!next)
+        return -1;
+    double wait = next - monotime();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+int stop_all() {
+    struct service *stopping[MAXSERVICES];
+    int count = 0;
+
+    for (int i = 0; i < service_count; i++) {
+        if (SERV_ALIVE(services[i]))
+            stopping[count++] = services[i];
+    }
+    return count ? stop_servs(stopping, count) : 0;
+}
+
+/**
+ * switches to the services of target: stops the running services
+ * that neither it nor its services depend on, and starts the ones
+ * that aren't running yet through the start plan. services in both
+ * sets are left alone.
+**/
+int isolate(char target[]) {
+    char buf[1024], fname[320];
+    char *line, *saveptr;
+    struct service *stopping[MAXSERVICES];
+    int count = 0, retval = 0;
+
+    if (!*target || strchr(target, '/') || !strcmp(target, ".") || !strcmp(target, "..")) {
+        sys_eprintf("error: invalid target %s\n", target);
+        return 1;
+    }
+
+    struct servlist wanted = get_target_servs(target);
+    if (wanted.servc < 0) {
+        sys_eprintf("error: target %s doesn't exist\n", target);
+        return 1;
+    }
+    sys_iprintf("isolating target %s...\n", target);
+
+    /* what the target depends on stays too */
+    for (int i = 0; i < wanted.servc; i++) {
+        get_servtext(wanted.services[i], "depends", buf, sizeof(buf));
+        for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            int known = 0;
+            for (int j = 0; j < wanted.servc && !known; j++)
+                known = !strcmp(wanted.services[j], line);
+            snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s", line);
+            if (!known && wanted.servc < MAXSERVICES && strlen(line) < sizeof(wanted.services[0])
+                && access(fname, F_OK) == 0)
+                strcpy(wanted.services[wanted.servc++], line);
+        }
+    }
+
+    for (int i = 0; i < service_count; i++) {
+        int keep = 0;
+        for (int j = 0; j < wanted.servc && !keep; j++)
+            keep = !strcmp(wanted.services[j], services[i]->name);
+        if (keep)
+            continue;
+        /* the old target's plan doesn't get to start it either */
+        if (services[i]->planned == PLAN_WAITING) {
+            services[i]->planned = PLAN_NONE;
+            plan.count--;
+        }
+        if (SERV_ALIVE(services[i]))
+            stopping[count++] = services[i];
+    }
+    if (count)
+        retval += stop_servs(stopping, count);
+
+    /* the missing ones start in dependency order, like on boot */
+    snprintf(current_target, sizeof(current_target), "%s", target);
+    plan_start(&wanted);
+    timers_load();
+    activations_load();
+    sys_iprintf("target %s has been isolated\n", target);
+
+    return retval;
+}
+
+int restart_serv(char servname[]) {
+    struct service *serv = find_serv(servname);
+
+    if (!serv || serv->state != SERV_RUNNING) {
+        sys_eprintf("error: %s isn't running\n", servname);
+        return 1;
+    }
+
+    /* stop_done() starts it again */
+    serv->restart_pending = 1;
+    if (stop_servs(&serv, 1) != 0) {
+        serv->restart_pending = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * reloads the configuration of a running service in place. services
+ * with a reload executable get it run, everybody else gets their
+ * reload signal. the reload executable has to finish, and services
+ * with a notify fd have to report ready again, within RELOADTIMEOUT
+ * seconds, which the event loop waits for, see reload_advance().
+ * control clients get their answer once that is over. services
+ * that can't reload (reloadsig is none) are restarted instead.
+**/
+int reload_serv(char servname[]) {
+    struct service *serv = find_serv(servname);
+    char fname[320];
+    int retval;
+
+    if (!serv || serv->state != SERV_RUNNING) {
+        sys_eprintf("error: %s isn't running\n", servname);
+        return 1;
+    }
+    if (serv->reload_until || serv->reload_pid) {
+        sys_eprintf("error: %s is already reloading\n", servname);
+        return 1;
+    }
+
+    /* reloading is how edited settings get picked up, so
+       the manifest has to pick them up as well */
+    manifest_update(servname);
+    get_servconf(servname, &serv->conf);
+    snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s/reload", servname);
+    int has_command = access(fname, X_OK) == 0;
+    if (!has_command && !serv->conf.reloadsig) {
+        sys_iprintf("service %s can't reload, restarting it instead\n", servname);
+        return restart_serv(servname);
+    }
+
+    sys_iprintf("reloading service %s...\n", servname);
+    serv->reload_at = monotime();
+
+    /* whatever it said before doesn't count */
+    char buf[64];
+    if (serv->notifyfd >= 0)
+        while (read(serv->notifyfd, buf, sizeof(buf)) > 0);
+
+    if (has_command) {
+        retval = run_reload(fname, serv);
+    } else {
+        retval = kill(serv->procid, serv->conf.reloadsig) != 0;
+        if (retval)
+            sys_perror("reload_serv(): kill");
+    }
+    if (retval) {
+        sys_eprintf("error: reloading %s failed\n", servname);
+        return 1;
+    }
+
+    /* the reload executable and the ready report come through the
+       event loop, everybody else is done */
+    serv->reload_ready = 0;
+    if (has_command || serv->notifyfd >= 0)
+        serv->reload_until = serv->reload_at + RELOADTIMEOUT;
+    else
+        reload_done(serv);
+
+    return 0;
+}
+
+/**
+ * finishes reloading serv, once it's ready again.
+**/
+void reload_done(struct service *serv) {
+    reload_reply(serv, 0, NULL);
+    journal_append(serv, JNL_RELOAD, 0);
+    sys_iprintf("service %s has been reloaded\n", serv->name);
+    metrics.reloads++;
+    hist_observe(&metrics.reload_latency, monotime() - serv->reload_at);
+}
+
+/**
+ * ends the reload of serv and answers the control clients waiting
+ * for it with retval, and why it failed unless that is NULL.
+**/
+void reload_reply(struct service *serv, int retval, char *why) {
+    serv->reload_until = 0;
+    for (int i = 0; i < client_count; i++) {
+        struct client *client = &clients[i];
+        if (client->reloading != serv)
+            continue;
+        client->reloading = NULL;
+        client->replying = 1;
+        client->out.len = 0;
+        client->sent = 0;
+        bufprintf(&client->out, "%c", retval);
+        if (why)
+            bufprintf(&client->out, "error: %s %s\n", serv->name, why);
+    }
+}
+
+/**
+ * reads what the reload executable of serv wrote into the log of
+ * the service, like log_read().
+**/
+void reload_read(struct service *serv) {
+    char buf[4096];
+    ssize_t count;
+
+    while ((count = read(serv->reload_outfd, buf, sizeof(buf))) > 0)
+        log_feed(serv, buf, count);
+    if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(serv->reload_outfd);
+        serv->reload_outfd = -1;
+    }
+}
+
+/**
+ * takes the reload executable of serv, which exited with status,
+ * and its output. services that report readiness still have to.
+**/
+void reload_reaped(struct service *serv, int status) {
+    serv->reload_pid = 0;
+    /* its children may hold on to the pipe, it's done anyway */
+    if (serv->reload_outfd >= 0) {
+        reload_read(serv);
+        if (serv->reload_outfd >= 0)
+            close(serv->reload_outfd);
+        serv->reload_outfd = -1;
+    }
+
+    /* reload_advance() gave up on it already */
+    if (!serv->reload_until)
+        return;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        sys_eprintf("error: reloading %s failed\n", serv->name);
+        reload_reply(serv, 1, "failed to reload");
+    } else if (serv->notifyfd < 0 || serv->reload_ready) {
+        reload_done(serv);
+    }
+}
+
+/**
+ * fails the reloads that didn't finish within RELOADTIMEOUT seconds,
+ * or can't anymore, killing their reload executable. the service is
+ * left running as it is. called from the event loop, like
+ * stop_advance().
+**/
+void reload_advance() {
+    double now = monotime();
+
+    for (int i = 0; i < service_count; i++) {
+        struct service *serv = services[i];
+        if (!serv->reload_until)
+            continue;
+
+        if (serv->state != SERV_RUNNING || serv->stopping) {
+            reload_reply(serv, 1, "stopped before it reloaded");
+        } else if (!serv->reload_pid && serv->notifyfd < 0) {
+            sys_wprintf("warning: %s closed its notify fd while reloading\n", serv->name);
+            reload_reply(serv, 1, "closed its notify fd while reloading");
+        } else if (now >= serv->reload_until) {
+            sys_wprintf("warning: %s didn't finish reloading in time\n", serv->name);
+            reload_reply(serv, 1, "didn't finish reloading in time");
+        } else {
+            continue;
+        }
+        if (serv->reload_pid)
+            kill(serv->reload_pid, SIGKILL);
+    }
+}
+
+/**
+ * returns how long the event loop may sleep before reload_advance()
+ * has something to do, in milliseconds, or -1 for forever.
+**/
+int reload_timeout() {
+    double next = 0;
+
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->reload_until && (!next || services[i]->reload_until < next))
+            next = services[i]->reload_until;
+    }
+    if (!next)
+        return -1;
+    double wait = next - monotime();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+/**
+ * starts the reload executable of serv with its pid as argument.
+ * reap_children() hands it to reload_reaped() once it exits, and
+ * reload_advance() kills it if it takes longer than RELOADTIMEOUT
+ * seconds. returns 0 if it was started.
+**/
+int run_reload(char fname[], struct service *serv) {
+    char pid[16];
+    int output[2];
+
+    snprintf(pid, sizeof(pid), "%d", serv->procid);
+    if (pipe2(output, O_CLOEXEC) != 0) {
+        sys_perror("run_reload(): pipe2");
+        return 1;
+    }
+
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        char *const args[] = { fname, pid, NULL };
+
+        logging_async = 0;
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        dup2(output[1], 1);
+
+        execv(fname, args);
+        sys_perror("run_reload(): execv");
+        _exit(-1);
+    } else if (child_pid < 0) {
+        sys_perror("run_reload(): fork");
+        close(output[0]);
+        close(output[1]);
+        return 1;
+    }
+    close(output[1]);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+    serv->reload_pid = child_pid;
+    serv->reload_outfd = output[0];
+
+    return 0;
+}
+
+/**
+ * reads what serv wrote to its notify fd. returns 1 if it reported
+ * ready (wrote a newline), 0 if not (yet) and -1 if it closed the fd.
+**/
+int notify_read(struct service *serv) {
+    char buf[64];
+    ssize_t count = read(serv->notifyfd, buf, sizeof(buf));
+
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(serv->notifyfd);
+        serv->notifyfd = -1;
+        return -1;
+    }
+    return count > 0 && memchr(buf, '\n', count) != NULL;
+}
+
+/**
+ * parses a signal like HUP, SIGUSR1 or 10. returns 0 if it's none.
+**/
+int parse_signal(char *str) {
+    static const struct { char *name; int signo; } signals[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM },
+        { "WINCH", SIGWINCH }, { "CONT", SIGCONT },
+    };
+    char *end;
+
+    long signo = strtol(str, &end, 10);
+    if (end != str && *end == '\0')
+        return signo > 0 && signo < NSIG ? signo : 0;
+
+    if (!strncmp(str, "SIG", 3))
+        str += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(*signals); i++) {
+        if (!strcmp(str, signals[i].name))
+            return signals[i].signo;
+    }
+    return 0;
+}
+
+int run_command(unsigned char command, char servname[]) {
+    int retval = 0;
+
+    switch (command) {
+        case 0x1A:
+            retval = start_serv(servname);
+            break;
+        case 0x1B:
+            retval = start_all();
+            break;
+        case 0x1C:
+            retval = stop_serv(servname);
+            break;
+        case 0x1D:
+            retval = stop_all();
+            break;
+        case 0x1E:
+            retval = restart_serv(servname);
+            break;
+        case 0x1F:
+            retval = reload_serv(servname);
+            break;
+        case 0x2A:
+            retval = status(servname);
+            break;
+        case 0x2B:
+            retval = showlog(servname, 0, 0, NULL);
+            break;
+        case 0x3A:
+            retval = list(0, 0);
+            break;
+        case 0x3B:
+            retval = list(1, 0);
+            break;
+        case 0x3C:
+            retval = list(0, 1);
+            break;
+        case 0x4A:
+            retval = enable_serv(servname);
+            manifest_load(1);
+            timers_load();
+            activations_load();
+            break;
+        case 0x4B:
+            retval = disable_serv(servname);
+            manifest_load(1);
+            timers_load();
+            activations_load();
+            break;
+        case 0x4C:
+            retval = manifest_load(2) != 0;
+            timers_load();
+            activations_load();
+            break;
+        case 0x5A:
+            retval = isolate(servname);
+            break;
+        default:
+            retval = 255;
+            sys_eprintf("error: unrecognized command\n", NULL);
+            break;
+    }
+    sys_cprintf("command %#04x returned %d\n", command, retval);
+
+    return retval;
+}
+
+/**
+ * tells whether command changes anything, rather than just
+ * reporting. unknown commands count as changing.
+**/
+int command_mutates(unsigned char command) {
+    switch (command) {
+        case 0x2A:
+        case 0x2B:
+        case 0x2C:
+        case 0x2D:
+        case 0x3A:
+        case 0x3B:
+        case 0x3C:
+        case 0x3D:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * runs a command received on the control socket, writing
+ * whatever the client should see to out.
+**/
+int run_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *out) {
+    static struct servstate states[MAXSERVICES];
+    int retval = 0;
+
+    switch (command) {
+        case 0x2C: {
+            /* pick up services that appeared on disk since we started */
+            manifest_load(1);
+            struct servlist servs = get_available_servs();
+            for (int i = 0; i < servs.servc; i++) {
+                if (!find_serv(servs.services[i]))
+                    add_serv(servs.services[i]);
+            }
+        }
+        /* fall through */
+        case 0x2D:
+        case 0x3C:
+        case 0x3D: {
+            int count = state_snapshot(statepage, states);
+            retval = render_states(out, command, flags, servname, states, count);
+            if (retval == -3) {
+                bufprintf(out, "error: %s doesn't exist\n", servname);
+                retval = 1;
+            }
+            break;
+        }
+        default:
+            return run_command(command, servname);
+    }
+    sys_cprintf("query %#04x returned %d\n", command, retval);
+
+    return retval;
+}
+
+/**
+ * renders the answer to a status or list query from a snapshot of
+ * the state page. this runs in the daemon as well as in the cli.
+ * returns -3 if servname isn't in the snapshot.
+**/
+int render_states(struct outbuf *out, unsigned char command, unsigned char flags, char servname[], struct servstate *states, int count) {
+    int json = flags & QUERY_JSON;
+    int first = 1;
+
+    switch (command) {
+        case 0x2C:
+            if (json)
+                bufprintf(out, "[");
+            else
+                bufprintf(out, "%-24s %-8s %7s %12s %8s %s\n",
+                          "SERVICE", "STATE", "PID", "UPTIME", "RESTARTS", "LAST EXIT");
+            for (int i = 0; i < count; i++) {
+                if (json && i)
+                    bufprintf(out, ",");
+                render_serv(out, &states[i], flags, 1);
+            }
+            if (json)
+                bufprintf(out, "]\n");
+            return 0;
+        case 0x2D:
+            for (int i = 0; i < count; i++) {
+                if (strcmp(states[i].name, servname))
+                    continue;
+                render_serv(out, &states[i], flags, 0);
+                if (json)
+                    bufprintf(out, "\n");
+                return 0;
+            }
+            return -3;
+        case 0x3C:
+            if (json)
+                bufprintf(out, "[");
+            for (int i = 0; i < count; i++) {
+                if (states[i].state != SERV_RUNNING)
+                    continue;
+                if (json) {
+                    bufprintf(out, first ? "" : ",");
+                    render_json_string(out, states[i].name);
+                } else {
+                    bufprintf(out, "%s\n", states[i].name);
+                }
+                first = 0;
+            }
+            if (json)
+                bufprintf(out, "]\n");
+            return 0;
+        case 0x3D: {
+            struct servstate *sorted[MAXSERVICES];
+            int timerc = 0;
+            for (int i = 0; i < count; i++) {
+                if (states[i].next_run)
+                    sorted[timerc++] = &states[i];
+            }
+            qsort(sorted, timerc, sizeof(*sorted), compare_next_run);
+
+            if (json)
+                bufprintf(out, "[");
+            else
+                bufprintf(out, "%-19s %12s %s\n", "NEXT RUN", "LEFT", "SERVICE");
+            for (int i = 0; i < timerc; i++) {
+                time_t next = sorted[i]->next_run;
+                if (json) {
+                    bufprintf(out, "%s{\"name\":", i ? "," : "");
+                    render_json_string(out, sorted[i]->name);
+                    bufprintf(out, ",\"next_run\":%lld}", (long long)next);
+                    continue;
+                }
+
+                char stamp[32];
+                struct tm tm;
+                struct outbuf left = { 0 };
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&next, &tm));
+                render_duration(&left, next > time(NULL) ? difftime(next, time(NULL)) : 0);
+                bufprintf(out, "%-19s %12s %s\n", stamp, left.data, sorted[i]->name);
+                free(left.data);
+            }
+            if (json)
+                bufprintf(out, "]\n");
+            return 0;
+        }
+    }
+    return 255;
+}
+
+int compare_next_run(const void *a, const void *b) {
+    int64_t x = (*(struct servstate *const *)a)->next_run;
+    int64_t y = (*(struct servstate *const *)b)->next_run;
+    return (x > y) - (x < y);
+}
+
+void render_duration(struct outbuf *out, double seconds) {
+    long total = (long)seconds;
+    if (total >= 86400)
+        bufprintf(out, "%ldd ", total / 86400);
+    if (total >= 3600)
+        bufprintf(out, "%ldh ", total / 3600 % 24);
+    if (total >= 60)
+        bufprintf(out, "%ldm ", total / 60 % 60);
+    bufprintf(out, "%lds", total % 60);
+}
+
+void render_json_string(struct outbuf *out, char *str) {
+    bufprintf(out, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            bufprintf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            bufprintf(out, "\\u%04x", *str);
+        else
+            bufprintf(out, "%c", *str);
+    }
+    bufprintf(out, "\"");
+}
+
+/**
+ * renders one service. oneline selects the table row used
+ * by `status --all` over the `status service` block.
+**/
+void render_serv(struct outbuf *out, struct servstate *serv, int flags, int oneline) {
+    int running = SERV_ALIVE(serv);
+    char *state = serv->state >= 0 && serv->state < SERV_STATES ? servstates[serv->state] : "unknown";
+    double uptime = running ? difftime(time(NULL), serv->started_at) : 0;
+
+    char last_exit[32] = "-";
+    if (serv->last_status != -1 && WIFSIGNALED(serv->last_status))
+        snprintf(last_exit, sizeof(last_exit), "signal %d", WTERMSIG(serv->last_status));
+    else if (serv->last_status != -1)
+        snprintf(last_exit, sizeof(last_exit), "code %d", WEXITSTATUS(serv->last_status));
+
+    if (flags & QUERY_JSON) {
+        bufprintf(out, "{\"name\":");
+        render_json_string(out, serv->name);
+        bufprintf(out, ",\"state\":\"%s\"", state);
+        if (running)
+            bufprintf(out, ",\"pid\":%d,\"started\":%lld,\"uptime\":%ld",
+                      serv->pid, (long long)serv->started_at, (long)uptime);
+        else
+            bufprintf(out, ",\"pid\":null,\"started\":null,\"uptime\":null");
+        if (serv->next_run)
+            bufprintf(out, ",\"next_run\":%lld", (long long)serv->next_run);
+        else
+            bufprintf(out, ",\"next_run\":null");
+        bufprintf(out, ",\"restarts\":%d,\"last_exit\":", serv->restarts);
+        if (serv->last_status != -1 && WIFSIGNALED(serv->last_status))
+            bufprintf(out, "{\"signal\":%d}}", WTERMSIG(serv->last_status));
+        else if (serv->last_status != -1)
+            bufprintf(out, "{\"code\":%d}}", WEXITSTATUS(serv->last_status));
+        else
+            bufprintf(out, "null}");
+    } else if (oneline) {
+        struct outbuf upbuf = { 0 };
+        char pid[16] = "-";
+        if (running) {
+            render_duration(&upbuf, uptime);
+            snprintf(pid, sizeof(pid), "%d", serv->pid);
+        }
+        bufprintf(out, "%-24s %-8s %7s %12s %8d %s\n", serv->name, state,
+                  pid, running ? upbuf.data : "-", serv->restarts, last_exit);
+        free(upbuf.data);
+    } else {
+        bufprintf(out, "%s - %s\n", serv->name, state);
+        if (running) {
+            bufprintf(out, "main pid: %d, uptime: ", serv->pid);
+            render_duration(out, uptime);
+            bufprintf(out, "\n");
+        } else {
+            bufprintf(out, "main pid: -1\n");
+        }
+        if (serv->next_run) {
+            time_t next = serv->next_run;
+            char stamp[32];
+            struct tm tm;
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&next, &tm));
+            bufprintf(out, "next run: %s\n", stamp);
+        }
+        bufprintf(out, "restarts: %d, last exit: %s\n\n", serv->restarts, last_exit);
+    }
+}
+
+/**
+ * creates the state page. readers map SHMSTATEPATH and read it
+ * with state_snapshot(), without ever talking to the daemon.
+**/
+void state_open() {
+    /* no O_TRUNC, readers may still have the last daemon's page mapped
+       and would get SIGBUS. the seqlock tells them it changed instead. */
+    int fd = open(SHMSTATEPATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(struct statepage)) != 0
+        || (statepage = mmap(NULL, sizeof(struct statepage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        sys_perror("state_open()");
+        /* keep going with a private page, queries still work */
+        if (!(statepage = calloc(1, sizeof(struct statepage)))) malloc_fail();
+    }
+    if (fd >= 0)
+        close(fd);
+
+    /* odd while we reset, in case the last daemon died mid-update */
+    unsigned int seq = atomic_load_explicit(&statepage->seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&statepage->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    statepage->size = sizeof(struct statepage);
+    statepage->count = 0;
+    statepage->daemon_pid = getpid();
+    memset(statepage->servs, 0, sizeof(statepage->servs));
+
+    atomic_store_explicit(&statepage->seq, seq + 1, memory_order_release);
+    atomic_store_explicit(&statepage->magic, STATEMAGIC, memory_order_release);
+}
+
+/**
+ * copies serv to its slot of the state page. the seqlock has a
+ * single writer, the event loop.
+**/
+void state_publish(struct service *serv) {
+    struct servstate *rec = &statepage->servs[serv->slot];
+
+    unsigned int seq = atomic_load_explicit(&statepage->seq, memory_order_relaxed);
+    atomic_store_explicit(&statepage->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    snprintf(rec->name, sizeof(rec->name), "%s", serv->name);
+    rec->pid = SERV_ALIVE(serv) ? serv->procid : 0;
+    rec->state = serv->state;
+    rec->started_at = serv->started_at;
+    rec->restarts = serv->restart_times;
+    rec->last_status = serv->last_status;
+    rec->next_run = serv->next_run;
+    if ((uint32_t)serv->slot >= statepage->count)
+        statepage->count = serv->slot + 1;
+
+    atomic_store_explicit(&statepage->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * takes a consistent copy of all services on page.
+ * returns the number of services, or -1 if the page
+ * stayed busy (e.g. the daemon died mid-update).
+**/
+int state_snapshot(struct statepage *page, struct servstate *states) {
+    for (int tries = 0; tries < 10000; tries++) {
+        unsigned int seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        uint32_t count = page->count;
+        if (count > MAXSERVICES)
+            count = MAXSERVICES;
+        memcpy(states, page->servs, count * sizeof(struct servstate));
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&page->seq, memory_order_relaxed) == seq)
+            return count;
+    }
+    return -1;
+}
+
+struct statepage *state_map() {
+    int fd = open(SHMSTATEPATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    struct statepage *page = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(struct statepage))
+        page = mmap(NULL, sizeof(struct statepage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (page == MAP_FAILED)
+        return NULL;
+    if (atomic_load_explicit(&page->magic, memory_order_acquire) != STATEMAGIC || page->size != sizeof(struct statepage)
+        || kill(page->daemon_pid, 0) != 0) {
+        munmap(page, sizeof(struct statepage));
+        return NULL;
+    }
+    return page;
+}
+
+/**
+ * answers a status or list query from the state page.
+ * returns -3 if the daemon has to be asked instead.
+**/
+int local_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *out) {
+    static struct servstate states[MAXSERVICES];
+
+    struct statepage *page = state_map();
+    if (page == NULL)
+        return -3;
+
+    int count = state_snapshot(page, states);
+    munmap(page, sizeof(struct statepage));
+    if (count < 0)
+        return -3;
+
+    return render_states(out, command, flags, servname ? servname : "", states, count);
+}
+
+/**
+ * reads /etc/kanrisha.d/available/<servname>/<key> into buf,
+ * without the trailing newline. returns -1 if it doesn't exist.
+**/
+int read_servfile(char servname[], char key[], char *buf, size_t len) {
+    char fname[320];
+    snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s/%s", servname, key);
+
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t count = read(fd, buf, len - 1);
+    close(fd);
+    if (count < 0)
+        return -1;
+
+    buf[count] = '\0';
+    while (count > 0 && (buf[count - 1] == '\n' || buf[count - 1] == ' '))
+        buf[--count] = '\0';
+    return 0;
+}
+
+/**
+ * loads the per-service settings. every setting is a small file
+ * in the service directory, next to run:
+ *   priority - services with a lower priority are shed first (default 0)
+ *   shed     - "stop" or "freeze" to shed the service under memory pressure
+ *   reloadsig - signal that makes it reload, like USR1 (default HUP).
+ *               "none" makes `kanrisha reload` restart it instead
+ *   notify   - fd number the service writes a newline to once it is
+ *              ready, after starting as well as after reloading
+ *   depends  - services that have to be ready before `kanrisha start`
+ *              starts it, one per line. see get_servtext()
+ *   activate - start it only once one of these conditions holds,
+ *              see activations_check()
+ *   schedule - run the service from a timer instead of keeping it up.
+ *              one setting per line:
+ *                interval 6h              - every 6 hours
+ *                calendar 30 4 * * 1-5    - like a crontab entry
+ *                randomdelay 15m          - delay each run by up to 15 minutes
+ *                catchup                  - make up for missed runs on startup
+**/
+void load_servconf(char servname[], struct servconf *conf) {
+    char buf[1024];
+    char *line, *saveptr;
+
+    memset(conf, 0, sizeof(struct servconf));
+    conf->reloadsig = RELOADSIGNAL;
+    conf->notify = -1;
+
+    if (read_servfile(servname, "priority", buf, sizeof(buf)) == 0)
+        conf->priority = atoi(buf);
+
+    if (read_servfile(servname, "shed", buf, sizeof(buf)) == 0)
+        conf->shed = !strcmp(buf, "freeze") ? SHED_FREEZE : SHED_STOP;
+
+    if (read_servfile(servname, "reloadsig", buf, sizeof(buf)) == 0) {
+        conf->reloadsig = parse_signal(buf);
+        if (!conf->reloadsig && strcmp(buf, "none"))
+            sys_wprintf("warning: bad reload signal of %s, it can't reload\n", servname);
+    }
+
+    if (read_servfile(servname, "notify", buf, sizeof(buf)) == 0 && (conf->notify = atoi(buf)) < 3) {
+        sys_wprintf("warning: notify fd of %s has to be 3 or higher\n", servname);
+        conf->notify = -1;
+    }
+
+    if (read_servfile(servname, "schedule", buf, sizeof(buf)) != 0)
+        return;
+    for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char *arg = line + strcspn(line, " \t");
+        if (*arg)
+            *arg++ = '\0';
+        arg += strspn(arg, " \t");
+
+        int bad = 0;
+        if (!strcmp(line, "interval"))
+            bad = (conf->sched.interval = parse_duration(arg)) <= 0;
+        else if (!strcmp(line, "calendar"))
+            bad = parse_calendar(arg, &conf->sched) != 0;
+        else if (!strcmp(line, "randomdelay"))
+            bad = (conf->sched.randomdelay = parse_duration(arg)) < 0;
+        else if (!strcmp(line, "catchup"))
+            conf->sched.catchup = 1;
+        else if (*line && *line != '#')
+            bad = 1;
+
+        if (bad) {
+            sys_wprintf("warning: ignoring bad schedule of %s\n", servname);
+            memset(&conf->sched, 0, sizeof(struct schedule));
+            return;
+        }
+    }
+    if (conf->sched.interval && conf->sched.calendar) {
+        sys_wprintf("warning: %s has both an interval and a calendar, using the interval\n", servname);
+        conf->sched.calendar = 0;
+    }
+}
+
+/**
+ * returns the mtime of path in nanoseconds, or -1 if it doesn't exist.
+**/
+int64_t mtime_of(char *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return -1;
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+/**
+ * compiles the services in /etc/kanrisha.d into the manifest at
+ * MANIFESTPATH, so that they can be loaded with one mmap instead of
+ * walking the tree and reading every setting file. expects the old
+ * manifest to be unmapped already. returns -1 if it can't be written,
+ * quietly if that's only because we aren't root.
+**/
+int manifest_compile() {
+    char fname[320];
+    struct manifest header = { .magic = MANIFESTMAGIC, .size = sizeof(struct manifestent) };
+
+    /* stamp before looking, so that changes made meanwhile invalidate it */
+    header.available_mtime = mtime_of("/etc/kanrisha.d/available");
+    header.enabled_mtime = mtime_of("/etc/kanrisha.d/enabled");
+
+    struct servlist *servs;
+    if (!(servs = malloc(sizeof(struct servlist)))) malloc_fail();
+    *servs = get_available_servs();
+
+    /* every path built below has to fit in fname, the reload one is the longest */
+    int kept = 0;
+    for (int i = 0; i < servs->servc; i++) {
+        int len = snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s/reload", servs->services[i]);
+        if (len < 0 || (size_t)len >= sizeof(fname)) {
+            sys_wprintf("warning: name of %s is too long, leaving it out of the manifest\n", servs->services[i]);
+            continue;
+        }
+        if (kept != i)
+            strcpy(servs->services[kept], servs->services[i]);
+        kept++;
+    }
+    servs->servc = kept;
+    qsort(servs->services, servs->servc, sizeof(servs->services[0]), compare_names);
+
+    /* the mftexts files go into the string table as well */
+    char **texts;
+    if (!(texts = calloc(servs->servc * MF_TEXTS, sizeof(char *)))) malloc_fail();
+    header.count = servs->servc;
+    for (int i = 0; i < servs->servc; i++) {
+        header.strsize += strlen(servs->services[i]) + 1;
+        for (int j = 0; j < MF_TEXTS; j++) {
+            char buf[1024];
+            if (read_servfile(servs->services[i], mftexts[j], buf, sizeof(buf)) != 0)
+                *buf = '\0';
+            if (!(texts[i * MF_TEXTS + j] = strdup(buf))) malloc_fail();
+            header.strsize += strlen(buf) + 1;
+        }
+    }
+
+    size_t len = sizeof(struct manifest) + header.count * sizeof(struct manifestent) + header.strsize;
+    struct manifest *mf;
+    if (!(mf = calloc(1, len))) malloc_fail();
+    *mf = header;
+
+    char *strtab = (char *)&mf->servs[mf->count];
+    uint32_t stroff = 0;
+    for (uint32_t i = 0; i < mf->count; i++) {
+        struct manifestent *ent = &mf->servs[i];
+        char *servname = servs->services[i];
+
+        ent->name = stroff;
+        strcpy(strtab + stroff, servname);
+        stroff += strlen(servname) + 1;
+        for (int j = 0; j < MF_TEXTS; j++) {
+            char *text = texts[i * MF_TEXTS + j];
+            ent->texts[j] = stroff;
+            strcpy(strtab + stroff, text);
+            stroff += strlen(text) + 1;
+            free(text);
+        }
+
+        load_servconf(servname, &ent->conf);
+        ent->flags = manifest_flags(servname);
+    }
+    free(texts);
+    free(servs);
+
+    int retval = manifest_write(mf, len);
+    free(mf);
+    return retval;
+}
+
+/**
+ * returns the MF_* flags of servname, whose name fits the paths
+ * built here, see manifest_compile().
+**/
+uint32_t manifest_flags(char servname[]) {
+    char fname[320];
+    struct stat st;
+    uint32_t flags = 0;
+
+    snprintf(fname, sizeof(fname), "/etc/kanrisha.d/available/%s/reload", servname);
+    if (access(fname, X_OK) == 0)
+        flags |= MF_RELOADCMD;
+    snprintf(fname, sizeof(fname), "/etc/kanrisha.d/enabled/%s", servname);
+    if (stat(fname, &st) == 0 && S_ISDIR(st.st_mode))
+        flags |= MF_ENABLED;
+
+    return flags;
+}
+
+/**
+ * writes the manifest mf of len bytes to MANIFESTPATH. readers may
+ * have the old one mapped, so it is replaced rather than rewritten.
+ * returns -1 if it can't be written, quietly if that's only because
+ * we aren't root.
+**/
+int manifest_write(struct manifest *mf, size_t len) {
+    char dirname[sizeof(MANIFESTPATH)] = MANIFESTPATH;
+    char fname[sizeof(MANIFESTPATH) + 4];
+
+    *strrchr(dirname, '/') = '\0';
+    mkdir(dirname, 0755);
+    snprintf(fname, sizeof(fname), "%s.new", MANIFESTPATH);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (errno != EACCES && errno != EROFS)
+            sys_perror("manifest_write(): open");
+        return -1;
+    }
+    int failed = write_all(fd, (char *)mf, len) != 0;
+    failed |= close(fd) != 0;
+    if (failed || rename(fname, MANIFESTPATH) != 0) {
+        sys_perror("manifest_write()");
+        unlink(fname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * recompiles the entry of servname from its files, and copies the
+ * others from the manifest we have mapped, so that reloading one
+ * service doesn't read all of them again. without a manifest, or
+ * with servname not in it, there is nothing to do. if the new one
+ * can't be written, the old one is dropped, as it is stale now.
+**/
+void manifest_update(char servname[]) {
+    struct manifestent *old = manifest_find(servname);
+    char *texts[MF_TEXTS];
+    char buf[1024];
+
+    if (!old)
+        return;
+
+    uint32_t strsize = manifest->strsize;
+    char *oldtab = (char *)&manifest->servs[manifest->count];
+    for (int j = 0; j < MF_TEXTS; j++) {
+        if (read_servfile(servname, mftexts[j], buf, sizeof(buf)) != 0)
+            *buf = '\0';
+        if (!(texts[j] = strdup(buf))) malloc_fail();
+        strsize += strlen(texts[j]) - strlen(oldtab + old->texts[j]);
+    }
+
+    size_t len = sizeof(struct manifest) + manifest->count * sizeof(struct manifestent) + strsize;
+    struct manifest *mf;
+    if (!(mf = calloc(1, len))) malloc_fail();
+    *mf = *manifest;
+    mf->strsize = strsize;
+
+    char *strtab = (char *)&mf->servs[mf->count];
+    uint32_t stroff = 0;
+    for (uint32_t i = 0; i < mf->count; i++) {
+        struct manifestent *ent = &mf->servs[i];
+        *ent = manifest->servs[i];
+
+        ent->name = stroff;
+        strcpy(strtab + stroff, oldtab + manifest->servs[i].name);
+        stroff += strlen(strtab + stroff) + 1;
+        for (int j = 0; j < MF_TEXTS; j++) {
+            char *text = &manifest->servs[i] == old ? texts[j] : oldtab + manifest->servs[i].texts[j];
+            ent->texts[j] = stroff;
+            strcpy(strtab + stroff, text);
+            stroff += strlen(text) + 1;
+        }
+        if (&manifest->servs[i] == old) {
+            load_servconf(servname, &ent->conf);
+            ent->flags = manifest_flags(servname);
+        }
+    }
+    for (int j = 0; j < MF_TEXTS; j++)
+        free(texts[j]);
+
+    int failed = manifest_write(mf, len) != 0;
+    free(mf);
+    if (failed || manifest_load(0) != 0) {
+        /* better none than a stale one */
+        if (manifest) {
+            munmap(manifest, manifest_len);
+            manifest = NULL;
+        }
+        unlink(MANIFESTPATH);
+    }
+}
+
+/**
+ * checks that the manifest mapped at mf is intact and still matches
+ * the directories it was compiled from, which only takes two stat()s
+ * however many services there are. services coming and going, and
+ * getting enabled or disabled, change those. edited settings aren't
+ * seen here, `kanrisha compile` and `kanrisha reload` pick them up.
+**/
+int manifest_valid(struct manifest *mf, size_t len) {
+    if (len < sizeof(struct manifest) || mf->magic != MANIFESTMAGIC || mf->size != sizeof(struct manifestent)
+        || len != sizeof(struct manifest) + (size_t)mf->count * sizeof(struct manifestent) + mf->strsize)
+        return 0;
+
+    char *strtab = (char *)&mf->servs[mf->count];
+    if (mf->strsize && strtab[mf->strsize - 1] != '\0')
+        return 0;
+
+    if (mf->available_mtime != mtime_of("/etc/kanrisha.d/available")
+        || mf->enabled_mtime != mtime_of("/etc/kanrisha.d/enabled"))
+        return 0;
+
+    for (uint32_t i = 0; i < mf->count; i++) {
+        if (mf->servs[i].name >= mf->strsize)
+            return 0;
+        for (int j = 0; j < MF_TEXTS; j++) {
+            if (mf->servs[i].texts[j] >= mf->strsize)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * maps the manifest, recompiling it first if it is stale and compile
+ * is 1, or in any case if compile is 2. without a usable manifest,
+ * manifest stays NULL and everything walks /etc/kanrisha.d as before.
+ * returns 0 if there is one.
+**/
+int manifest_load(int compile) {
+    struct stat st;
+
+    /* nothing may find the old mapping once it's gone */
+    if (manifest) {
+        struct manifest *old = manifest;
+        manifest = NULL;
+        munmap(old, manifest_len);
+    }
+
+    for (int tries = 0; tries < 2; tries++) {
+        if (compile == 2 || tries) {
+            if (!compile || manifest_compile() != 0)
+                return -1;
+        }
+
+        int fd = open(MANIFESTPATH, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        struct manifest *mf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mf == MAP_FAILED)
+            continue;
+
+        if (manifest_valid(mf, st.st_size)) {
+            manifest = mf;
+            manifest_len = st.st_size;
+            return 0;
+        }
+        munmap(mf, st.st_size);
+        if (compile == 2)
+            return -1;
+    }
+    return -1;
+}
+
+int compare_manifestent(const void *key, const void *ent) {
+    return strcmp(key, MANIFEST_NAME((struct manifestent *)ent));
+}
+
+struct manifestent *manifest_find(char servname[]) {
+    if (!manifest)
+        return NULL;
+    return bsearch(servname, manifest->servs, manifest->count, sizeof(struct manifestent), compare_manifestent);
+}
+
+/**
+ * like load_servconf(), but from the manifest if servname is in it.
+**/
+void get_servconf(char servname[], struct servconf *conf) {
+    struct manifestent *ent = manifest_find(servname);
+
+    if (ent)
+        *conf = ent->conf;
+    else
+        load_servconf(servname, conf);
+}
+
+/**
+ * recompiles the manifest, in the daemon if it is running, so that
+ * it maps the new one as well.
+**/
+int compile() {
+    struct outbuf reply = { 0 };
+
+    int retval = daemon_query(0x4C, 0, NULL, &reply);
+    if (retval == -3)
+        retval = manifest_load(2) != 0;
+    else if (retval == 0)
+        retval = manifest_load(0) != 0;
+    free(reply.data);
+
+    if (retval != 0) {
+        fprintf(stderr, "error: cannot compile %s\n", MANIFESTPATH);
+        return 1;
+    }
+    printf("compiled %u services into %s\n", manifest->count, MANIFESTPATH);
+    return 0;
+}
+
+/**
+ * registers a memory pressure trigger. the kernel then wakes us with
+ * POLLPRI whenever tasks stalled on memory for more than the trigger's
+ * threshold within its window.
+**/
+int psi_open() {
+#ifdef PSITRIGGER
+    int fd = open(PSIPATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        sys_perror("psi_open(): open");
+        return -1;
+    }
+    if (write(fd, PSITRIGGER, strlen(PSITRIGGER) + 1) < 0) {
+        sys_perror("psi_open(): write");
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * sheds the running sheddable service with the lowest priority,
+ * by stopping or freezing it. returns 1 if there was none.
+**/
+int shed_one() {
+    struct service *victim = NULL;
+
+    pressure_at = monotime();
+
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->state == SERV_RUNNING && !services[i]->stopping && services[i]->conf.shed != SHED_NONE
+            && (!victim || services[i]->conf.priority < victim->conf.priority))
+            victim = services[i];
+    }
+    if (victim == NULL) {
+        sys_wprintf("warning: memory pressure, but nothing left to shed\n", NULL);
+        return 1;
+    }
+
+    sys_wprintf("memory pressure, shedding service %s\n", victim->name);
+    if (victim->conf.shed == SHED_FREEZE) {
+        if (kill(victim->procid, SIGSTOP) != 0) {
+            sys_perror("shed_one(): kill");
+            return 1;
+        }
+        victim->state = SERV_FROZEN;
+    } else {
+        /* stop_done() does the rest */
+        if (stop_servs(&victim, 1) != 0)
+            return 1;
+        victim->stop_state = SERV_SHED;
+        return 0;
+    }
+    state_publish(victim);
+    journal_append(victim, JNL_SHED, victim->conf.shed);
+    metrics.sheds++;
+
+    return 0;
+}
+
+/**
+ * brings back the shed service with the highest priority, once
+ * pressure has stayed away for PSIHOLDDOWN seconds. services come
+ * back one per hold-down period, so the pressure doesn't come right back.
+**/
+void restore_one() {
+    struct service *serv = NULL;
+
+    if (monotime() - pressure_at < PSIHOLDDOWN)
+        return;
+
+    for (int i = 0; i < service_count; i++) {
+        if ((services[i]->state == SERV_SHED || services[i]->state == SERV_FROZEN)
+            && (!serv || services[i]->conf.priority > serv->conf.priority))
+            serv = services[i];
+    }
+    if (serv == NULL)
+        return;
+
+    pressure_at = monotime();
+    sys_iprintf("memory pressure is gone, restoring service %s\n", serv->name);
+    if (serv->state == SERV_FROZEN) {
+        kill(serv->procid, SIGCONT);
+        serv->state = SERV_RUNNING;
+        state_publish(serv);
+    } else if (start_serv(serv->name) != 0) {
+        return;
+    }
+    journal_append(serv, JNL_RESTORE, 0);
+}
+
+/**
+ * returns how long the event loop may sleep before restore_one()
+ * has something to do, in milliseconds, or -1 for forever.
+**/
+int psi_timeout() {
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->state == SERV_SHED || services[i]->state == SERV_FROZEN) {
+            double wait = pressure_at + PSIHOLDDOWN - monotime();
+            return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * parses a duration like 90, 90s, 30m, 12h or 7d into seconds.
+ * returns -1 if it isn't one.
+**/
+long parse_duration(char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+
+    if (end == str || value < 0)
+        return -1;
+    switch (*end) {
+        case '\0':
+        case 's': break;
+        case 'm': value *= 60; break;
+        case 'h': value *= 3600; break;
+        case 'd': value *= 86400; break;
+        default: return -1;
+    }
+    return end[0] && end[1] ? -1 : value;
+}
+
+/**
+ * parses one field of a calendar expression into a bitmask of the
+ * values in [min, max] it matches. fields are comma-separated lists
+ * of *, n or n-m, each optionally followed by /step, like in crontabs.
+**/
+int parse_calfield(char *field, int min, int max, uint64_t *mask) {
+    char *item, *saveptr;
+
+    *mask = 0;
+    for (item = strtok_r(field, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        long from = min, to = max, step = 1;
+        char *end = item;
+
+        if (*item == '*') {
+            end++;
+        } else {
+            from = to = strtol(item, &end, 10);
+            if (end == item)
+                return -1;
+            if (*end == '-')
+                to = strtol(end + 1, &end, 10);
+        }
+        if (*end == '/')
+            step = strtol(end + 1, &end, 10);
+        if (*end != '\0' || from < min || to > max || from > to || step < 1)
+            return -1;
+
+        for (long i = from; i <= to; i += step)
+            *mask |= (uint64_t)1 << i;
+    }
+    return *mask ? 0 : -1;
+}
+
+/**
+ * parses a calendar expression: minute hour day-of-month month
+ * day-of-week, each a field as understood by parse_calfield().
+**/
+int parse_calendar(char *expr, struct schedule *sched) {
+    static const int mins[] = { 0, 0, 1, 1, 0 };
+    static const int maxs[] = { 59, 23, 31, 12, 7 };
+    char *field, *saveptr;
+    int i = 0;
+
+    for (field = strtok_r(expr, " \t", &saveptr); field; field = strtok_r(NULL, " \t", &saveptr), i++) {
+        if (i == 5 || parse_calfield(field, mins[i], maxs[i], &sched->fields[i]) != 0)
+            return -1;
+    }
+    /* sunday is both 0 and 7 */
+    if (sched->fields[CAL_WDAY] & (1 << 7))
+        sched->fields[CAL_WDAY] |= 1;
+
+    sched->calendar = i == 5;
+    return i == 5 ? 0 : -1;
+}
+
+/**
+ * returns the first time after after that matches the calendar
+ * expression of sched, or -1 if there is none within 5 years.
+**/
+time_t next_calendar(struct schedule *sched, time_t after) {
+    struct tm tm;
+    time_t limit = after + 5 * 366 * 86400;
+    /* crontab semantics: if both day fields are restricted,
+       either of them may match */
+    int restricted_mday = (~sched->fields[CAL_MDAY] & 0xfffffffeULL) != 0;
+    int restricted_wday = (~sched->fields[CAL_WDAY] & 0x7fULL) != 0;
+
+    after += 60 - after % 60;
+    localtime_r(&after, &tm);
+    tm.tm_sec = 0;
+
+    while (1) {
+        tm.tm_isdst = -1;
+        if (mktime(&tm) > limit)
+            return -1;
+
+        if (!(sched->fields[CAL_MON] & ((uint64_t)1 << (tm.tm_mon + 1)))) {
+            tm.tm_mon++;
+            tm.tm_mday = 1;
+            tm.tm_hour = tm.tm_min = 0;
+            continue;
+        }
+
+        int mday = (sched->fields[CAL_MDAY] >> tm.tm_mday) & 1;
+        int wday = (sched->fields[CAL_WDAY] >> tm.tm_wday) & 1;
+        if (restricted_mday && restricted_wday ? !(mday || wday) : !(mday && wday)) {
+            tm.tm_mday++;
+            tm.tm_hour = tm.tm_min = 0;
+            continue;
+        }
+
+        if (!(sched->fields[CAL_HOUR] & ((uint64_t)1 << tm.tm_hour))) {
+            tm.tm_hour++;
+            tm.tm_min = 0;
+            continue;
+        }
+
+        if (!(sched->fields[CAL_MIN] & ((uint64_t)1 << tm.tm_min))) {
+            tm.tm_min++;
+            continue;
+        }
+
+        return mktime(&tm);
+    }
+}
+
+/**
+ * returns when a run of serv is due, given that it last ran at last
+ * (or never, if last is 0). missed runs are made up for right away
+ * only if the schedule says catchup.
+**/
+time_t next_run(struct service *serv, time_t last) {
+    struct schedule *sched = &serv->conf.sched;
+    time_t now = time(NULL);
+    time_t due;
+
+    if (sched->interval)
+        due = (last ? last : now) + sched->interval;
+    else
+        due = next_calendar(sched, last ? last : now);
+
+    if (due != -1 && due <= now) {
+        if (sched->catchup)
+            due = now;
+        else if (sched->interval)
+            due = now + sched->interval;
+        else
+            due = next_calendar(sched, now);
+    }
+    if (due == -1)
+        return -1;
+
+    /* spread the runs of many machines with the same schedule */
+    if (sched->randomdelay)
+        due += random() % (sched->randomdelay + 1);
+
+    return due;
+}
+
+/**
+ * returns when the timer of servname last fired, from the mtime of
+ * its stamp file, or 0 if it never did.
+**/
+time_t last_run(char servname[]) {
+    char fname[320];
+    struct stat st;
+
+    snprintf(fname, sizeof(fname), "%s/%s", TIMERSTAMPDIR, servname);
+    return stat(fname, &st) == 0 ? st.st_mtime : 0;
+}
+
+void touch_last_run(char servname[]) {
+    char fname[320];
+
+    snprintf(fname, sizeof(fname), "%s/%s", TIMERSTAMPDIR, servname);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || futimens(fd, NULL) != 0)
+        sys_perror("touch_last_run()");
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * the timer heap, a binary min-heap of scheduled services ordered by
+ * next_run. the timerfd is always armed for the root.
+**/
+void timer_push(struct service *serv) {
+    int i = timers.count++;
+
+    while (i > 0 && timers.heap[(i - 1) / 2]->next_run > serv->next_run) {
+        timers.heap[i] = timers.heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers.heap[i] = serv;
+}
+
+struct service *timer_pop() {
+    struct service *root = timers.heap[0];
+    struct service *last = timers.heap[--timers.count];
+    int i = 0;
+
+    while (2 * i + 1 < timers.count) {
+        int child = 2 * i + 1;
+        if (child + 1 < timers.count && timers.heap[child + 1]->next_run < timers.heap[child]->next_run)
+            child++;
+        if (last->next_run <= timers.heap[child]->next_run)
+            break;
+        timers.heap[i] = timers.heap[child];
+        i = child;
+    }
+    timers.heap[i] = last;
+
+    return root;
+}
+
+void timer_arm() {
+    struct itimerspec when = { 0 };
+
+    if (timers.fd < 0)
+        return;
+    if (timers.count)
+        when.it_value.tv_sec = timers.heap[0]->next_run;
+    /* CANCEL_ON_SET tells us about clock jumps, calendar
+       schedules have to be recomputed after those */
+    if (timerfd_settime(timers.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &when, NULL) != 0)
+        sys_perror("timer_arm(): timerfd_settime");
+}
+
+/**
+ * (re)builds the timer heap from the scheduled services of the
+ * current target. called on startup and whenever the target,
+ * the enabled services or the clock change.
+**/
+void timers_load() {
+    struct servlist servs = get_target_servs(current_target);
+
+    for (int i = 0; i < service_count; i++)
+        services[i]->next_run = 0;
+    timers.count = 0;
+
+    for (int i = 0; i < servs.servc; i++) {
+        struct service *serv = find_serv(servs.services[i]);
+        if (!serv)
+            serv = add_serv(servs.services[i]);
+        if (!serv)
+            continue;
+
+        get_servconf(serv->name, &serv->conf);
+        if (!SCHEDULED(serv))
+            continue;
+
+        serv->next_run = next_run(serv, last_run(serv->name));
+        if (serv->next_run == -1) {
+            sys_wprintf("warning: schedule of %s never matches\n", serv->name);
+            serv->next_run = 0;
+        } else {
+            timer_push(serv);
+        }
+    }
+
+    for (int i = 0; i < service_count; i++)
+        state_publish(services[i]);
+    timer_arm();
+}
+
+/**
+ * starts every service whose run is due, schedules its next run and
+ * rearms the timer. a run is skipped if the last one is still going.
+**/
+void timers_fire() {
+    uint64_t expirations;
+    time_t now = time(NULL);
+
+    if (read(timers.fd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED) {
+        sys_iprintf("system clock changed, rescheduling timers\n", NULL);
+        timers_load();
+        return;
+    }
+
+    while (timers.count && timers.heap[0]->next_run <= now) {
+        struct service *serv = timer_pop();
+
+        if (SERV_ALIVE(serv)) {
+            sys_wprintf("warning: %s is still running, skipping this run\n", serv->name);
+        } else {
+            sys_iprintf("timer of %s elapsed\n", serv->name);
+            touch_last_run(serv->name);
+            if (start_serv(serv->name) == 0)
+                metrics.timer_runs++;
+        }
+
+        serv->next_run = next_run(serv, now);
+        if (serv->next_run == -1)
+            serv->next_run = 0;
+        else
+            timer_push(serv);
+        state_publish(serv);
+    }
+    timer_arm();
+}
+
+/**
+ * opens the inotify fd and the uevent socket activation
+ * conditions are watched with.
+**/
+void activations_open() {
+    if ((activation.inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        sys_perror("activations_open(): inotify_init1");
+
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    activation.ueventfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (activation.ueventfd < 0 || bind(activation.ueventfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        sys_perror("activations_open(): uevent socket");
+        if (activation.ueventfd >= 0)
+            close(activation.ueventfd);
+        activation.ueventfd = -1;
+    }
+}
+
+/**
+ * (re)arms the activation conditions of the services of the current
+ * target that aren't running, and starts the ones whose conditions
+ * already hold. called from start_all() and whenever the target or
+ * the enabled services change, like timers_load(). path conditions
+ * that aren't absolute are dropped here, with a warning.
+**/
+void activations_load() {
+    char buf[1024], conds[sizeof(buf) + 1];
+    char *line, *saveptr;
+    struct servlist servs = get_target_servs(current_target);
+
+    for (int i = 0; i < service_count; i++)
+        services[i]->awaiting = 0;
+
     for (int i = 0; i < servs.servc; i++) {
-        retval += stop_serv(servs.services[i]);
+        struct service *serv = find_serv(servs.services[i]);
+        if (!serv)
+            serv = add_serv(servs.services[i]);
+        if (!serv)
+            continue;
+
+        free(serv->activate);
+        serv->activate = NULL;
+        get_servtext(serv->name, "activate", buf, sizeof(buf));
+        if (!*buf)
+            continue;
+
+        *conds = '\0';
+        for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            size_t keylen = strcspn(line, " \t");
+            char *arg = line + keylen + strspn(line + keylen, " \t");
+            if (((keylen == 4 && !strncmp(line, "path", 4)) || (keylen == 11 && !strncmp(line, "dirnotempty", 11)))
+                && *arg != '/') {
+                sys_wprintf("warning: ignoring a relative path in the activation conditions of %s\n", serv->name);
+                continue;
+            }
+            strcat(strcat(conds, line), "\n");
+        }
+        if (!(serv->activate = strdup(conds))) malloc_fail();
+        serv->awaiting = !SERV_ALIVE(serv);
+    }
+
+    activations_watch();
+    activations_check(NULL, 0);
+}
+
+/**
+ * watches the directories path and dirnotempty conditions depend on.
+ * paths that don't exist yet are watched through their closest
+ * ancestor that does, and rewatched once something appears there.
+**/
+void activations_watch() {
+    char buf[1024], dir[PATH_MAX];
+    char *line, *saveptr;
+    struct stat st;
+
+    if (activation.inotifyfd < 0)
+        return;
+    for (int i = 0; i < activation.wdc; i++)
+        inotify_rm_watch(activation.inotifyfd, activation.wds[i]);
+    activation.wdc = 0;
+
+    for (int i = 0; i < service_count; i++) {
+        if (!services[i]->awaiting)
+            continue;
+
+        snprintf(buf, sizeof(buf), "%s", services[i]->activate);
+        for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            char *arg = line + strcspn(line, " \t");
+            if (*arg)
+                *arg++ = '\0';
+            arg += strspn(arg, " \t");
+            if ((strcmp(line, "path") && strcmp(line, "dirnotempty")) || *arg != '/')
+                continue;
+
+            /* a path appears in its parent, a directory fills up in itself */
+            snprintf(dir, sizeof(dir), "%s", arg);
+            if (!strcmp(line, "path") || stat(dir, &st) != 0)
+                *strrchr(dir, '/') = '\0';
+            while (*dir && stat(dir, &st) != 0)
+                *strrchr(dir, '/') = '\0';
+
+            /* a watch we can't keep track of could never be removed */
+            if (activation.wdc == MAXWATCHES) {
+                sys_wprintf("warning: too many activation watches, not watching for %s\n", services[i]->name);
+                continue;
+            }
+            int wd = inotify_add_watch(activation.inotifyfd, *dir ? dir : "/",
+                                       IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB);
+            if (wd < 0)
+                sys_perror("activations_watch(): inotify_add_watch");
+            else
+                activation.wds[activation.wdc++] = wd;
+        }
+    }
+}
+
+/**
+ * starts every service waiting for activation with a condition that
+ * holds now, or matches uevent, if given. conditions are lines of
+ * the activate file, any of which activates the service:
+ *   path /dev/sdb                 - once the path exists
+ *   dirnotempty /var/spool/work   - once the directory has something in it
+ *   uevent SUBSYSTEM=block DEVNAME=sd*
+ *                                 - once the kernel sends a uevent where every
+ *                                   key matches, values may be globs
+**/
+void activations_check(char *uevent, size_t len) {
+    char buf[1024];
+    char *line, *saveptr;
+
+    for (int i = 0; i < service_count; i++) {
+        struct service *serv = services[i];
+        int holds = 0;
+        if (!serv->awaiting)
+            continue;
+        /* started by hand meanwhile */
+        if (SERV_ALIVE(serv)) {
+            serv->awaiting = 0;
+            continue;
+        }
+
+        snprintf(buf, sizeof(buf), "%s", serv->activate);
+        for (line = strtok_r(buf, "\n", &saveptr); line && !holds; line = strtok_r(NULL, "\n", &saveptr)) {
+            char *arg = line + strcspn(line, " \t");
+            if (*arg)
+                *arg++ = '\0';
+            arg += strspn(arg, " \t");
+
+            if (!strcmp(line, "path")) {
+                holds = access(arg, F_OK) == 0;
+            } else if (!strcmp(line, "dirnotempty")) {
+                DIR *dir = opendir(arg);
+                struct dirent *dent;
+                while (dir && !holds && (dent = readdir(dir)) != NULL)
+                    holds = strcmp(dent->d_name, ".") && strcmp(dent->d_name, "..");
+                if (dir)
+                    closedir(dir);
+            } else if (!strcmp(line, "uevent")) {
+                holds = uevent && uevent_matches(arg, uevent, len);
+            } else if (*line && *line != '#' && !uevent) {
+                sys_wprintf("warning: ignoring bad activation condition of %s\n", serv->name);
+            }
+        }
+        if (!holds)
+            continue;
+
+        sys_iprintf("activation condition of %s holds\n", serv->name);
+        serv->awaiting = 0;
+        start_serv(serv->name);
+    }
+}
+
+/**
+ * checks whether the uevent, a header followed by nul-separated
+ * KEY=value pairs, has every KEY=pattern in conds.
+**/
+int uevent_matches(char *conds, char *uevent, size_t len) {
+    char buf[1024];
+    char *cond, *saveptr;
+
+    snprintf(buf, sizeof(buf), "%s", conds);
+    for (cond = strtok_r(buf, " \t", &saveptr); cond; cond = strtok_r(NULL, " \t", &saveptr)) {
+        char *pattern = strchr(cond, '=');
+        if (!pattern)
+            return 0;
+        *pattern++ = '\0';
+
+        int found = 0;
+        for (char *pair = uevent + strlen(uevent) + 1; pair < uevent + len && !found; pair += strlen(pair) + 1) {
+            size_t keylen = strlen(cond);
+            found = !strncmp(pair, cond, keylen) && pair[keylen] == '='
+                    && fnmatch(pattern, pair + keylen + 1, 0) == 0;
+        }
+        if (!found)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * handles whatever woke the event loop on the inotify fd or the
+ * uevent socket.
+**/
+void activations_read(int fd) {
+    char buf[8192];
+    ssize_t count;
+
+    if (fd == activation.inotifyfd) {
+        while (read(fd, buf, sizeof(buf)) > 0);
+        activations_watch();
+        activations_check(NULL, 0);
+        return;
+    }
+
+    /* only the kernel's, not udev's or anybody else's */
+    struct sockaddr_nl addr;
+    socklen_t addrlen = sizeof(addr);
+    while ((count = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, &addrlen)) > 0) {
+        buf[count] = '\0';
+        if (addr.nl_pid == 0 && strchr(buf, '@'))
+            activations_check(buf, count);
+        addrlen = sizeof(addr);
+    }
+}
+
+int rundaemon() {
+    /* setup child watcher. children are reaped from the event loop,
+       never from a signal handler, which could land anywhere */
+    sigset_t chldset;
+    sigemptyset(&chldset);
+    sigaddset(&chldset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldset, NULL);
+    int chldfd = signalfd(-1, &chldset, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (chldfd < 0) {
+        sys_perror("rundaemon(): signalfd");
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* init system logging stuff */
+    openlog("kanrisha", LOG_PID, LOG_DAEMON);
+    log_start();
+
+    /* init service table and publish it */
+    if (!(services = calloc(MAXSERVICES, sizeof(struct service *)))) malloc_fail();
+    state_open();
+    if (!(journal = journal_map(1)))
+        sys_perror("rundaemon(): journal_map");
+    manifest_load(1);
+    struct servlist servs = get_available_servs();
+    for (int i = 0; i < servs.servc; i++)
+        add_serv(servs.services[i]);
+    timings_load();
+
+    /* init fifo. we keep it open for writing as well, so that
+       it never hits EOF between two clients */
+    mkfifo(CMDFIFOPATH, 0620);
+    int cmdfd = open(CMDFIFOPATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (cmdfd < 0) {
+        sys_perror("rundaemon(): open");
+        return -1;
+    }
+
+    /* init metrics sockets */
+    int safedir = runtime_dir() == 0;
+    int metricsfd = safedir ? listen_unix(METRICSSOCKPATH, METRICSSOCKPERMS) : -1;
+#ifdef METRICSPORT
+    int metricstcpfd = listen_tcp(METRICSPORT);
+#else
+    int metricstcpfd = -1;
+#endif
+
+    /* init control socket, for commands that want an answer */
+    int ctlfd = safedir ? listen_unix(CTLSOCKPATH, CTLSOCKPERMS) : -1;
+
+    /* init memory pressure trigger */
+    int psifd = psi_open();
+
+    /* init timers */
+    srandom(time(NULL) ^ getpid());
+    mkdir(TIMERSTAMPDIR, 0755);
+    if ((timers.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        sys_perror("rundaemon(): timerfd_create");
+
+    /* init activation watches */
+    activations_open();
+
+    /* init variables */
+    int pos = 0;
+    ssize_t count = 0;
+    unsigned char *command = malloc(sizeof(char) * (MAXSERVICES + 18));
+    struct pollfd fds[NLISTENFDS + MAXCLIENTS + 3 * MAXSERVICES];
+    struct service *notifying[MAXSERVICES];
+    struct service *logging[MAXSERVICES];
+    struct service *reloading[MAXSERVICES];
+    int notifyc, loggingc, reloadc;
+
+    /* start all enabled, since `kanrisha daemon` will probably only be run on boot. */
+    start_all();
+    timers_load();
+
+    /* main event loop */
+    while (1) {
+        fds[0].fd = cmdfd;
+        fds[1].fd = metricsfd;
+        fds[2].fd = metricstcpfd;
+        fds[3].fd = ctlfd;
+        fds[4].fd = psifd;
+        fds[5].fd = timers.fd;
+        fds[6].fd = activation.inotifyfd;
+        fds[7].fd = activation.ueventfd;
+        fds[8].fd = chldfd;
+        for (int i = 0; i < client_count; i++)
+            fds[NLISTENFDS + i].fd = clients[i].fd;
+        notifyc = 0;
+        for (int i = 0; i < service_count; i++) {
+            if (services[i]->notifyfd >= 0) {
+                notifying[notifyc] = services[i];
+                fds[NLISTENFDS + client_count + notifyc++].fd = services[i]->notifyfd;
+            }
+        }
+        loggingc = 0;
+        for (int i = 0; i < service_count; i++) {
+            if (services[i]->outfd >= 0) {
+                logging[loggingc] = services[i];
+                fds[NLISTENFDS + client_count + notifyc + loggingc++].fd = services[i]->outfd;
+            }
+        }
+        reloadc = 0;
+        for (int i = 0; i < service_count; i++) {
+            if (services[i]->reload_outfd >= 0) {
+                reloading[reloadc] = services[i];
+                fds[NLISTENFDS + client_count + notifyc + loggingc + reloadc++].fd = services[i]->reload_outfd;
+            }
+        }
+        int nfds = NLISTENFDS + client_count + notifyc + loggingc + reloadc;
+        for (int i = 0; i < nfds; i++)
+            fds[i].events = POLLIN;
+        fds[4].events = POLLPRI;
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].replying)
+                fds[NLISTENFDS + i].events = POLLOUT;
+            /* only hanging up is of interest while it waits */
+            else if (clients[i].reloading)
+                fds[NLISTENFDS + i].events = 0;
+        }
+
+        int timeout = -1;
+        int timeouts[] = { psi_timeout(), plan_timeout(), log_timeout(), stop_timeout(), reload_timeout() };
+        for (size_t i = 0; i < sizeof(timeouts) / sizeof(*timeouts); i++) {
+            if (timeouts[i] >= 0 && (timeout < 0 || timeouts[i] < timeout))
+                timeout = timeouts[i];
+        }
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno != EINTR)
+                sys_perror("rundaemon(): poll");
+            continue;
+        }
+
+        if (fds[8].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(chldfd, &info, sizeof(info)) > 0);
+            reap_children();
+        }
+
+        if (fds[4].revents & POLLERR) {
+            sys_wprintf("warning: memory pressure trigger failed, disabling load shedding\n", NULL);
+            close(psifd);
+            psifd = -1;
+        } else if (fds[4].revents & POLLPRI) {
+            shed_one();
+        }
+        restore_one();
+
+        if (fds[5].revents & POLLIN)
+            timers_fire();
+        if (fds[6].revents & POLLIN)
+            activations_read(activation.inotifyfd);
+        if (fds[7].revents & POLLIN)
+            activations_read(activation.ueventfd);
+
+        /* readiness notifications. reap_children() may have
+           restarted the service meanwhile, with a new pipe */
+        for (int i = 0; i < notifyc; i++) {
+            struct pollfd *pfd = &fds[NLISTENFDS + client_count + i];
+            struct service *serv = notifying[i];
+            if (!pfd->revents || pfd->fd != serv->notifyfd)
+                continue;
+            if (notify_read(serv) <= 0)
+                continue;
+            if (serv->ready_pending) {
+                serv_ready(serv);
+                sys_iprintf("service %s is ready\n", serv->name);
+            } else if (serv->reload_until && serv->reload_pid) {
+                serv->reload_ready = 1;
+            } else if (serv->reload_until) {
+                reload_done(serv);
+            }
+        }
+
+        /* service output, same here */
+        for (int i = 0; i < loggingc; i++) {
+            struct pollfd *pfd = &fds[NLISTENFDS + client_count + notifyc + i];
+            if (pfd->revents && pfd->fd == logging[i]->outfd)
+                log_read(logging[i]);
+        }
+        for (int i = 0; i < reloadc; i++) {
+            struct pollfd *pfd = &fds[NLISTENFDS + client_count + notifyc + loggingc + i];
+            if (pfd->revents && pfd->fd == reloading[i]->reload_outfd)
+                reload_read(reloading[i]);
+        }
+        plan_advance();
+        stop_advance();
+        reload_advance();
+
+        /* serve clients first, accepting may reorder the table */
+        for (int i = client_count - 1; i >= 0; i--) {
+            if (!fds[NLISTENFDS + i].revents)
+                continue;
+            /* hung up while it waited for a reload */
+            if (clients[i].reloading)
+                close_client(i);
+            else if (clients[i].replying ? write_client(i) : read_client(i))
+                close_client(i);
+        }
+        if (fds[1].revents & POLLIN)
+            accept_client(metricsfd, CLIENT_METRICS);
+        if (fds[2].revents & POLLIN)
+            accept_client(metricstcpfd, CLIENT_METRICS);
+        if (fds[3].revents & POLLIN)
+            accept_client(ctlfd, CLIENT_CTL);
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        /* read command session. commands are a command byte followed
+           by a nul-terminated service name, which may be empty */
+        while ((count = read(cmdfd, command + pos, sizeof(unsigned char))) > 0) {
+            /* fix overflow */
+            if (command[pos] != '\0' && pos < MAXSERVICES + 16) {
+                pos++;
+                continue;
+            }
+            command[pos] = '\0';
+            pos = 0;
+
+            double received_at = monotime();
+            run_command(command[0], (char *)command + 1);
+            metrics.commands++;
+            hist_observe(&metrics.command_rtt, monotime() - received_at);
+        }
+    }
+
+    unlink(CMDFIFOPATH);
+}
+
+/**
+ * reaps the children that exited and restarts the services that
+ * should be. called from the event loop when SIGCHLD arrives.
+**/
+void reap_children() {
+    pid_t chpid;
+    int status;
+    while ((chpid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct service *serv = NULL;
+        for (int i = 0; i < service_count; i++) {
+            if (services[i]->reload_pid == chpid)
+                serv = services[i];
+        }
+        if (serv) {
+            reload_reaped(serv, status);
+            continue;
+        }
+
+        for (int i = 0; i < service_count; i++) {
+            if (SERV_ALIVE(services[i]) && chpid == services[i]->procid) {
+                serv = services[i];
+                break;
+            }
+        }
+
+        if (WIFEXITED(status))
+            metrics.exit_codes[WEXITSTATUS(status)]++;
+        else if (WIFSIGNALED(status))
+            metrics.exit_signals[WTERMSIG(status)]++;
+
+        /* not one of ours (anymore) */
+        if (serv == NULL)
+            continue;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            serv->last_status = status;
+            serv->state = SERV_DEAD;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                serv->exited_normally = 1;
+            } else {
+                serv->exited_normally = 0;
+            }
+            state_publish(serv);
+            journal_append(serv, WIFSIGNALED(status) ? JNL_SIGNAL : JNL_EXIT, status);
+
+            if (serv->restart_when_dead && serv->restart_times < MAXSVCRESTART) {
+                sys_iprintf("service %s died, restarting\n", serv->name);
+                int restart_times = serv->restart_times + 1;
+                journal_append(serv, JNL_RESTART, restart_times);
+                if (!start_serv(serv->name)) {
+                    serv->restart_times = restart_times;
+                    metrics.restarts++;
+                    state_publish(serv);
+                }
+            } else if (serv->restart_when_dead) {
+                sys_wprintf("service %s died too often, not restarting it\n", serv->name);
+            } else if (serv->stopping) {
+                stop_done(serv);
+            }
+        }
+    }
+}
+
+int daemon_send(unsigned char command, char servname[]) {
+    /* open cmd fifo as write-only */
+    int cmdfd = open(CMDFIFOPATH, O_WRONLY | O_NONBLOCK);
+    if (cmdfd < 0) {
+        if (errno == ENOENT || errno == ENXIO) {
+            fprintf(stderr, "could not connect to kanrisha daemon, it is most likely not running.\n");
+            return -3;
+        }
+        perror("open");
+        return -1;
+    }
+
+    write(cmdfd, &command, sizeof(unsigned char));
+
+    if (servname == NULL)
+        servname = "";
+    write(cmdfd, servname, sizeof(char) * (strlen(servname) + 1));
+
+    return 0;
+}
+
+double monotime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void hist_observe(struct histogram *hist, double value) {
+    size_t bucket;
+    for (bucket = 0; bucket < HISTBUCKETS; bucket++) {
+        if (value <= histbounds[bucket])
+            break;
+    }
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+}
+
+void bufprintf(struct outbuf *out, char *format, ...) {
+    va_list args;
+    int len;
+
+    while (1) {
+        va_start(args, format);
+        len = vsnprintf(out->data + out->len, out->cap - out->len, format, args);
+        va_end(args);
+
+        if (len < 0)
+            return;
+        if (out->len + len < out->cap)
+            break;
+
+        /* grow and retry. the buffer is reused, so this settles quickly */
+        out->cap = (out->cap ? out->cap * 2 : 4096) + len;
+        if (!(out->data = realloc(out->data, out->cap))) malloc_fail();
+    }
+    out->len += len;
+}
+
+void render_hist(struct outbuf *out, char *name, char *help, struct histogram *hist) {
+    unsigned long cumulative = 0;
+
+    bufprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (size_t bucket = 0; bucket < HISTBUCKETS; bucket++) {
+        cumulative += hist->buckets[bucket];
+        bufprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, histbounds[bucket], cumulative);
+    }
+    bufprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n"
+                   "%s_sum %f\n"
+                   "%s_count %lu\n",
+                   name, hist->count, name, hist->sum, name, hist->count);
+}
+
+void render_metrics(struct outbuf *out) {
+    int running = 0;
+    for (int i = 0; i < service_count; i++)
+        running += services[i]->state == SERV_RUNNING;
+
+    out->len = 0;
+
+    bufprintf(out, "# HELP kanrisha_services_running Services currently supervised.\n"
+                   "# TYPE kanrisha_services_running gauge\n"
+                   "kanrisha_services_running %d\n", running);
+    bufprintf(out, "# HELP kanrisha_service_starts_total Services started.\n"
+                   "# TYPE kanrisha_service_starts_total counter\n"
+                   "kanrisha_service_starts_total %lu\n", metrics.starts);
+    bufprintf(out, "# HELP kanrisha_service_start_failures_total Service starts that failed.\n"
+                   "# TYPE kanrisha_service_start_failures_total counter\n"
+                   "kanrisha_service_start_failures_total %lu\n", metrics.start_failures);
+    bufprintf(out, "# HELP kanrisha_service_restarts_total Services restarted after dying.\n"
+                   "# TYPE kanrisha_service_restarts_total counter\n"
+                   "kanrisha_service_restarts_total %lu\n", metrics.restarts);
+    bufprintf(out, "# HELP kanrisha_service_stops_total Services stopped.\n"
+                   "# TYPE kanrisha_service_stops_total counter\n"
+                   "kanrisha_service_stops_total %lu\n", metrics.stops);
+    bufprintf(out, "# HELP kanrisha_service_sheds_total Services shed because of memory pressure.\n"
+                   "# TYPE kanrisha_service_sheds_total counter\n"
+                   "kanrisha_service_sheds_total %lu\n", metrics.sheds);
+    bufprintf(out, "# HELP kanrisha_timer_runs_total Services started by their timer.\n"
+                   "# TYPE kanrisha_timer_runs_total counter\n"
+                   "kanrisha_timer_runs_total %lu\n", metrics.timer_runs);
+    bufprintf(out, "# HELP kanrisha_service_reloads_total Services reloaded in place.\n"
+                   "# TYPE kanrisha_service_reloads_total counter\n"
+                   "kanrisha_service_reloads_total %lu\n", metrics.reloads);
+    bufprintf(out, "# HELP kanrisha_log_bytes_total Service output received.\n"
+                   "# TYPE kanrisha_log_bytes_total counter\n"
+                   "kanrisha_log_bytes_total %lu\n", metrics.log_bytes);
+    bufprintf(out, "# HELP kanrisha_log_stored_bytes_total Service output written to the archive, compressed.\n"
+                   "# TYPE kanrisha_log_stored_bytes_total counter\n"
+                   "kanrisha_log_stored_bytes_total %lu\n", metrics.log_stored_bytes);
+    bufprintf(out, "# HELP kanrisha_commands_total Commands handled by the daemon.\n"
+                   "# TYPE kanrisha_commands_total counter\n"
+                   "kanrisha_commands_total %lu\n", metrics.commands);
+
+    bufprintf(out, "# HELP kanrisha_log_messages_total Log messages written by the log writer.\n"
+                   "# TYPE kanrisha_log_messages_total counter\n"
+                   "kanrisha_log_messages_total %lu\n", atomic_load(&logring.written));
+    bufprintf(out, "# HELP kanrisha_log_dropped_total Log messages dropped because the log ring was full.\n"
+                   "# TYPE kanrisha_log_dropped_total counter\n"
+                   "kanrisha_log_dropped_total %lu\n", atomic_load(&logring.dropped));
+
+    bufprintf(out, "# HELP kanrisha_service_exits_total Service exits by return value or signal.\n"
+                   "# TYPE kanrisha_service_exits_total counter\n");
+    for (int code = 0; code < 256; code++) {
+        if (metrics.exit_codes[code])
+            bufprintf(out, "kanrisha_service_exits_total{code=\"%d\"} %lu\n", code, metrics.exit_codes[code]);
+    }
+    for (int signo = 1; signo < NSIG; signo++) {
+        if (metrics.exit_signals[signo])
+            bufprintf(out, "kanrisha_service_exits_total{signal=\"%d\"} %lu\n", signo, metrics.exit_signals[signo]);
+    }
+
+    bufprintf(out, "# HELP kanrisha_service_restart_count Times a service has been restarted since it was last started.\n"
+                   "# TYPE kanrisha_service_restart_count gauge\n");
+    for (int i = 0; i < service_count; i++) {
+        bufprintf(out, "kanrisha_service_restart_count{service=\"%s\"} %d\n",
+                  services[i]->name, services[i]->restart_times);
+    }
+
+    render_hist(out, "kanrisha_start_latency_seconds", "Time spent starting a service.", &metrics.start_latency);
+    render_hist(out, "kanrisha_stop_latency_seconds", "Time spent stopping a service.", &metrics.stop_latency);
+    render_hist(out, "kanrisha_reload_latency_seconds", "Time from asking a service to reload until it is ready again.", &metrics.reload_latency);
+    render_hist(out, "kanrisha_command_duration_seconds", "Time from receiving a command to finishing it.", &metrics.command_rtt);
+}
+
+/**
+ * creates RUNTIMEDIR, or makes sure that nobody but us could
+ * have put something there. returns 0 if it's safe to use.
+**/
+int runtime_dir() {
+    struct stat st;
+
+    if (mkdir(RUNTIMEDIR, 0755) != 0 && errno != EEXIST) {
+        sys_perror("runtime_dir(): mkdir");
+        return -1;
+    }
+    if (lstat(RUNTIMEDIR, &st) != 0) {
+        sys_perror("runtime_dir(): lstat");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        sys_eprintf("error: %s isn't a directory only we can write to, not listening there\n", RUNTIMEDIR);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * listens on a unix socket at path, which gets mode.
+**/
+int listen_unix(char *path, mode_t mode) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        sys_perror("listen_unix(): socket");
+        return -1;
+    }
+
+    /* nobody may connect before it has its mode */
+    unlink(path);
+    mode_t oldmask = umask(0777);
+    int failed = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0;
+    umask(oldmask);
+    if (failed || chmod(path, mode) != 0 || listen(fd, MAXCLIENTS) != 0) {
+        sys_perror("listen_unix(): bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listen_tcp(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        sys_perror("listen_tcp(): socket");
+        return -1;
     }
-    return retval;
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAXCLIENTS) != 0) {
+        sys_perror("listen_tcp(): bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-int restart_serv(char servname[]) {
-    int running = 0, i;
-    for (i = 0; i < service_count; i++) {
-        if (!strcmp(services[i]->name, servname)) {
-            running = 1;
+void accept_client(int listenfd, int kind) {
+    int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    if (client_count == MAXCLIENTS) {
+        sys_wprintf("warning: too many clients, dropping connection\n", NULL);
+        close(fd);
+        return;
+    }
+
+    clients[client_count].fd = fd;
+    clients[client_count].kind = kind;
+    clients[client_count].reqlen = 0;
+    clients[client_count].replying = 0;
+    clients[client_count].out = (struct outbuf){ 0 };
+    clients[client_count].sent = 0;
+    client_count++;
+}
+
+void close_client(int clientid) {
+    close(clients[clientid].fd);
+    free(clients[clientid].out.data);
+    clients[clientid] = clients[--client_count];
+}
+
+/**
+ * reads what the client has sent so far and serves it
+ * once the request is complete. returns 1 when the
+ * client is done and should be closed.
+**/
+int read_client(int clientid) {
+    struct client *client = &clients[clientid];
+
+    ssize_t count = read(client->fd, client->req + client->reqlen, sizeof(client->req) - 1 - client->reqlen);
+    if (count < 0)
+        return errno != EAGAIN && errno != EINTR;
+    client->reqlen += count;
+    client->req[client->reqlen] = '\0';
+
+    /* wait for the end of the request, unless the client gave up.
+       control requests are a command byte, a flags byte and a
+       nul-terminated service name. */
+    if (count > 0 && client->reqlen < sizeof(client->req) - 1) {
+        if (client->kind == CLIENT_METRICS && !strstr(client->req, "\r\n\r\n") && !strstr(client->req, "\n\n"))
+            return 0;
+        if (client->kind == CLIENT_CTL && (client->reqlen < 3 || !memchr(client->req + 2, '\0', client->reqlen - 2)))
+            return 0;
+    }
+
+    serve_client(client);
+    /* reload_reply() answers it */
+    if (client->reloading)
+        return 0;
+    return write_client(clientid);
+}
+
+/**
+ * puts the reply to the client's request into its out buffer,
+ * which write_client() sends as the socket takes it.
+**/
+void serve_client(struct client *client) {
+    static struct outbuf body;
+    unsigned char retval;
+
+    client->out.len = 0;
+    client->sent = 0;
+    client->replying = 1;
+
+    switch (client->kind) {
+        case CLIENT_METRICS:
+            render_metrics(&body);
+            bufprintf(&client->out, "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %zu\r\n"
+                                    "Connection: close\r\n\r\n", body.len);
+            break;
+        case CLIENT_CTL:
+            /* a truncated request just gets an error */
+            if (client->reqlen < 3)
+                client->req[0] = 0;
+            body.len = 0;
+            /* only root may change anything */
+            struct ucred cred;
+            socklen_t credlen = sizeof(cred);
+            if (command_mutates(client->req[0])
+                && (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 || cred.uid != 0)) {
+                bufprintf(&body, "error: permission denied\n");
+                retval = 1;
+            } else {
+                retval = run_query(client->req[0], client->req[1], client->req + 2, &body);
+            }
+            /* reloads answer once they're done, see reload_reply() */
+            struct service *serv = client->req[0] == 0x1F && !retval ? find_serv(client->req + 2) : NULL;
+            if (serv && serv->reload_until) {
+                client->reloading = serv;
+                client->replying = 0;
+                return;
+            }
+            bufprintf(&client->out, "%c", retval);
             break;
+    }
+    bufprintf(&client->out, "%.*s", (int)body.len, body.data ? body.data : "");
+}
+
+/**
+ * sends what the socket takes of the client's reply.
+ * returns 1 once it's all sent, or the client is gone.
+**/
+int write_client(int clientid) {
+    struct client *client = &clients[clientid];
+
+    while (client->sent < client->out.len) {
+        ssize_t count = write(client->fd, client->out.data + client->sent, client->out.len - client->sent);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno != EAGAIN;
         }
+        client->sent += count;
     }
+    return 1;
+}
 
-    if (running) {
-        stop_serv(servname);
-        start_serv(servname);
-    } else {
-        sys_eprintf("error: %s isn't running\n", servname);
-        return 1;
+int write_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t count = write(fd, buf, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += count;
+        len -= count;
+    }
+    return 0;
+}
+
+int show_metrics() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, METRICSSOCKPATH, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "could not connect to kanrisha daemon, it is most likely not running.\n");
+        return -3;
+    }
+
+    char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    write_all(fd, request, strlen(request));
+
+    /* print everything after the response header */
+    char buf[4096];
+    int inbody = 0, newlines = 0;
+    ssize_t count;
+    while ((count = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < count; i++) {
+            if (inbody) {
+                fwrite(buf + i, 1, count - i, stdout);
+                break;
+            }
+            if (buf[i] == '\n')
+                inbody = ++newlines == 2;
+            else if (buf[i] != '\r')
+                newlines = 0;
+        }
     }
-    sys_iprintf("service %s has been restarted\n", servname);
+    close(fd);
 
     return 0;
 }
 
-int rundaemon() {
-    /* setup child watcher */
-    if (signal(SIGCHLD, sigchld_handler) == SIG_ERR) {
-        sys_perror("rundaemon(): signal");
+int daemon_query(unsigned char command, unsigned char flags, char servname[], struct outbuf *reply) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, CTLSOCKPATH, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return -3;
     }
 
-    /* init system logging stuff */
-    openlog("kanrisha", LOG_PID, LOG_DAEMON);
+    if (servname == NULL)
+        servname = "";
+    unsigned char header[2] = { command, flags };
+    if (write_all(fd, (char *)header, 2) != 0 || write_all(fd, servname, strlen(servname) + 1) != 0) {
+        close(fd);
+        return -1;
+    }
 
-    /* init fifo */
-    mkfifo(CMDFIFOPATH, 0620);
+    /* the first byte of the reply is the return value */
+    unsigned char retval;
+    if (read(fd, &retval, 1) != 1) {
+        close(fd);
+        return -1;
+    }
 
-    /* init variables */
-    unsigned char *buf = NULL;
-    int pos = 0;
-    ssize_t count = 0;
-    unsigned char *command = malloc(sizeof(char) * (MAXSERVICES + 18));
+    char buf[4096];
+    ssize_t count;
+    while ((count = read(fd, buf, sizeof(buf))) > 0)
+        bufprintf(reply, "%.*s", (int)count, buf);
+    close(fd);
 
-    /* start all enabled, since `kanrisha daemon` will probably only be run on boot. */
-    start_all();
+    return retval;
+}
 
-    /* main command loop */
-    while (1) {
-        /* open cmd fifo as read-only */
-        int cmdfd = open(CMDFIFOPATH, O_RDONLY);
-        if (cmdfd < 0) {
-            sys_perror("rundaemon(): open");
-            return -1;
+int query(unsigned char command, unsigned char flags, char servname[]) {
+    struct outbuf reply = { 0 };
+
+    /* status and list queries can be answered from the state page */
+    int retval = -3;
+    if (command == 0x2C || command == 0x2D || command == 0x3C || command == 0x3D)
+        retval = local_query(command, flags, servname, &reply);
+    if (retval == -3)
+        retval = daemon_query(command, flags, servname, &reply);
+    if (retval == -3) {
+        fprintf(stderr, "could not connect to kanrisha daemon, it is most likely not running.\n");
+        return retval;
+    } else if (retval < 0) {
+        perror("daemon_query");
+        return retval;
+    }
+
+    if (reply.len)
+        fwrite(reply.data, 1, reply.len, retval ? stderr : stdout);
+    free(reply.data);
+
+    return retval;
+}
+
+/**
+ * takes len bytes of output of serv, prefixing every line with
+ * the time it arrived in milliseconds. the block is compressed into
+ * the archive once it is LOGBLOCKSIZE big or LOGFLUSH seconds old.
+**/
+void log_feed(struct service *serv, char *data, size_t len) {
+    struct logblock *blk = &serv->log;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    metrics.log_bytes += len;
+
+    while (len) {
+        if (blk->len + len + 32 > blk->cap) {
+            blk->cap = blk->len + len + 32 > 2 * blk->cap ? blk->len + len + 32 : 2 * blk->cap;
+            if (!(blk->raw = realloc(blk->raw, blk->cap))) malloc_fail();
         }
+        if (!blk->len) {
+            blk->first = ms;
+            blk->opened_at = monotime();
+        }
+        if (!blk->midline)
+            blk->len += sprintf(blk->raw + blk->len, "%lld ", (long long)ms);
+        blk->last = ms;
 
-        /* read command session */
-        while (count != 0) {
-            do {
-                count = read(cmdfd, &buf, sizeof(unsigned char));
-                if (*buf != '\0' && pos <= MAXSERVICES) {
-                    command[pos++] = *buf;
-                } else {
-                    break;
-                }
-            } while (count != 0);
+        char *newline = memchr(data, '\n', len);
+        size_t linelen = newline ? (size_t)(newline - data) + 1 : len;
+        memcpy(blk->raw + blk->len, data, linelen);
+        blk->len += linelen;
+        blk->midline = !newline;
+        data += linelen;
+        len -= linelen;
+    }
 
-            /* fix overflow */
-            if (pos >= MAXSERVICES) {
-                command[pos] = '\0';
-            }
-
-            int retval = 0;
-            char *servname = (char *)command;
-            servname++;
-
-            switch (command[0]) {
-                case 0x1A:
-                    retval = start_serv(servname);
-                    break;
-                case 0x1B:
-                    retval = start_all();
-                    break;
-                case 0x1C:
-                    retval = stop_serv(servname);
-                    break;
-                case 0x1D:
-                    retval = stop_all();
-                    break;
-                case 0x1E:
-                    retval = restart_serv(servname);
-                    break;
-                case 0x2A:
-                    retval = status(servname);
-                    break;
-                case 0x2B:
-                    retval = showlog(servname);
-                    break;
-                case 0x3A:
-                    retval = list(0, 0);
-                    break;
-                case 0x3B:
-                    retval = list(1, 0);
-                    break;
-                case 0x3C:
-                    retval = list(0, 1);
-                    break;
-                case 0x4A:
-                    retval = enable_serv(servname);
-                    break;
-                case 0x4B:
-                    retval = disable_serv(servname);
-                    break;
-                default:
-                    retval = 255;
-                    sys_eprintf("error: unrecognized command\n", NULL);
-                    break;
-            }
-            sys_cprintf("command %#04x returned %d\n", command[0], retval);
-        }
-
-        /* close fifos and init next session */
-        close(cmdfd);
+    if (blk->len >= LOGBLOCKSIZE)
+        log_flush(serv, 0);
+}
+
+/**
+ * compresses the pending block of serv and appends it to the current
+ * segment, then appends its index record. segments are named after
+ * the time they start at, a new one is started after LOGSEGMENTSIZE
+ * bytes and the oldest are deleted beyond LOGSEGMENTS. an incomplete
+ * last line stays for the next block, unless all is set or it is
+ * all there is.
+**/
+void log_flush(struct service *serv, int all) {
+    struct logblock *blk = &serv->log;
+    char fname[384];
+    size_t keep = 0;
+
+    if (!blk->len)
+        return;
+    /* a line may not span blocks, every line starts with its time */
+    if (blk->midline) {
+        char *newline = memrchr(blk->raw, '\n', blk->len);
+        if (all || !newline) {
+            blk->raw[blk->len++] = '\n';
+            blk->midline = 0;
+        } else {
+            keep = blk->len - (newline + 1 - blk->raw);
+            blk->len -= keep;
+        }
     }
 
-    unlink(CMDFIFOPATH);
+    uLongf size = compressBound(blk->len);
+    Bytef *packed;
+    if (!(packed = malloc(size))) malloc_fail();
+    if (compress2(packed, &size, (Bytef *)blk->raw, blk->len, LOGCOMPRESSION) != Z_OK) {
+        sys_eprintf("error: cannot compress output of %s, dropping it\n", serv->name);
+        free(packed);
+        blk->len = 0;
+        blk->midline = 0;
+        return;
+    }
+
+    if (!serv->segment || serv->segsize >= LOGSEGMENTSIZE) {
+        serv->segment = blk->first;
+        serv->segsize = 0;
+        snprintf(fname, sizeof(fname), "%s/%s", LOGARCHIVEDIR, serv->name);
+        mkdir(LOGARCHIVEDIR, 0755);
+        mkdir(fname, 0750);
+        log_prune(serv->name);
+    }
+
+    struct logindex idx = { .first = blk->first, .last = blk->last, .offset = serv->segsize,
+                            .size = size, .rawsize = blk->len };
+    snprintf(fname, sizeof(fname), "%s/%s/%013lld.seg", LOGARCHIVEDIR, serv->name, (long long)serv->segment);
+    int fd = open(fname, O_WRONLY | O_CREAT | O_CLOEXEC, LOGFILEPERMS);
+    ssize_t written = fd < 0 ? -1 : pwrite(fd, packed, size, idx.offset);
+    int failed = written != (ssize_t)size;
+    if (fd >= 0)
+        close(fd);
+
+    /* the index is written last, readers only trust what it points to */
+    if (!failed) {
+        snprintf(fname, sizeof(fname), "%s/%s/%013lld.idx", LOGARCHIVEDIR, serv->name, (long long)serv->segment);
+        fd = open(fname, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, LOGFILEPERMS);
+        failed = fd < 0 || write(fd, &idx, sizeof(idx)) != sizeof(idx);
+        if (fd >= 0)
+            close(fd);
+    }
+    if (failed)
+        sys_perror("log_flush()");
+    else
+        metrics.log_stored_bytes += size;
+
+    /* the next block goes after what made it to disk, so the index
+       never points past the end of the segment */
+    if (written > 0)
+        serv->segsize += written;
+    free(packed);
+
+    memmove(blk->raw, blk->raw + blk->len, keep);
+    blk->len = keep;
+    if (keep) {
+        blk->first = strtoll(blk->raw, NULL, 10);
+        blk->opened_at = monotime();
+    }
 }
 
-void sigchld_handler(int signo) {
-    if (signo == SIGCHLD) {
-        pid_t chpid;
-        int status;
-        while ((chpid = waitpid(-1, &status, WNOHANG)) > 0) {
-            int i;
-            for (i = 0; i < service_count; i++) {
-                if (chpid == services[i]->procid)
-                    break;
-            }
+/**
+ * deletes the oldest segments of servname beyond LOGSEGMENTS - 1,
+ * making room for a new one.
+**/
+void log_prune(char servname[]) {
+    int64_t *segs;
+    char fname[384];
 
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                int retval = WEXITSTATUS(status);
-                if (retval == 0 && !WIFSIGNALED(status)) {
-                    services[i]->exited_normally = 1;
-                } else {
-                    services[i]->exited_normally = 0;
-                }
+    if (!(segs = malloc(LOGMAXSEGMENTS * sizeof(int64_t)))) malloc_fail();
+    int count = log_segments(servname, segs, LOGMAXSEGMENTS);
+    for (int i = 0; i < count - (LOGSEGMENTS - 1); i++) {
+        snprintf(fname, sizeof(fname), "%s/%s/%013lld.idx", LOGARCHIVEDIR, servname, (long long)segs[i]);
+        unlink(fname);
+        snprintf(fname, sizeof(fname), "%s/%s/%013lld.seg", LOGARCHIVEDIR, servname, (long long)segs[i]);
+        unlink(fname);
+    }
+    free(segs);
+}
 
-                if (services[i]->restart_when_dead && services[i]->restart_times < MAXSVCRESTART) {
-                    sys_iprintf("service %s died, restarting\n", services[i]->name);
-                    stop_serv(services[i]->name);
-                    start_serv(services[i]->name);
-                    services[i]->restart_times++;
-                }
+/**
+ * reads the output pipe of serv into its log. closes the pipe
+ * and flushes the log once everybody closed the other end.
+**/
+void log_read(struct service *serv) {
+    char buf[4096];
+    ssize_t count;
+
+    while ((count = read(serv->outfd, buf, sizeof(buf))) > 0)
+        log_feed(serv, buf, count);
+    if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(serv->outfd);
+        serv->outfd = -1;
+        log_flush(serv, 1);
+    }
+}
+
+/**
+ * flushes the blocks that got too old and returns how long the
+ * event loop may sleep before the next one does, in milliseconds,
+ * or -1 for forever.
+**/
+int log_timeout() {
+    double first = -1;
+
+    for (int i = 0; i < service_count; i++) {
+        struct logblock *blk = &services[i]->log;
+        if (blk->len && monotime() - blk->opened_at >= LOGFLUSH)
+            log_flush(services[i], 0);
+        if (blk->len && (first < 0 || blk->opened_at < first))
+            first = blk->opened_at;
+    }
+    if (first < 0)
+        return -1;
+
+    double wait = first + LOGFLUSH - monotime();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+int compare_segments(const void *a, const void *b) {
+    int64_t x = *(int64_t *)a, y = *(int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * lists the segments of servname by their start time, oldest first.
+**/
+int log_segments(char servname[], int64_t *segs, int max) {
+    char dirname[320];
+    struct dirent *dent;
+    int count = 0;
+
+    snprintf(dirname, sizeof(dirname), "%s/%s", LOGARCHIVEDIR, servname);
+    DIR *dir = opendir(dirname);
+    if (dir == NULL)
+        return 0;
+    while ((dent = readdir(dir)) != NULL && count < max) {
+        long long start;
+        char ext[8];
+        if (sscanf(dent->d_name, "%lld.%7s", &start, ext) == 2 && !strcmp(ext, "idx"))
+            segs[count++] = start;
+    }
+    closedir(dir);
+    qsort(segs, count, sizeof(int64_t), compare_segments);
+
+    return count;
+}
+
+/**
+ * reads the index of a segment. returns the number of blocks in it,
+ * and the segment itself, opened, in segfd.
+**/
+int log_index(char servname[], int64_t seg, struct logindex **idx, int *segfd) {
+    char fname[384];
+    struct stat st;
+
+    *idx = NULL;
+    snprintf(fname, sizeof(fname), "%s/%s/%013lld.idx", LOGARCHIVEDIR, servname, (long long)seg);
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) != 0 || !(*idx = malloc(st.st_size + 1))) {
+        close(fd);
+        return 0;
+    }
+    ssize_t count = read(fd, *idx, st.st_size);
+    close(fd);
+    if (count < (ssize_t)sizeof(struct logindex))
+        return 0;
+
+    snprintf(fname, sizeof(fname), "%s/%s/%013lld.seg", LOGARCHIVEDIR, servname, (long long)seg);
+    if ((*segfd = open(fname, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    return count / sizeof(struct logindex);
+}
+
+/**
+ * reads and decompresses one block. returns its text, nul-terminated,
+ * or NULL if it's damaged.
+**/
+char *log_block(int segfd, struct logindex *idx) {
+    Bytef *packed;
+    char *raw;
+
+    if (!(packed = malloc(idx->size))) malloc_fail();
+    if (!(raw = malloc(idx->rawsize + 1))) malloc_fail();
+
+    uLongf rawsize = idx->rawsize;
+    if (pread(segfd, packed, idx->size, idx->offset) != (ssize_t)idx->size
+        || uncompress((Bytef *)raw, &rawsize, packed, idx->size) != Z_OK) {
+        free(packed);
+        free(raw);
+        return NULL;
+    }
+    free(packed);
+    raw[rawsize] = '\0';
+
+    return raw;
+}
+
+/**
+ * prints the lines of a block that are from within [since, until] (in
+ * milliseconds, 0 for no bound) and match re, if given. returns the
+ * number of lines printed.
+**/
+int log_print(FILE *out, char *block, int64_t since, int64_t until, regex_t *re) {
+    char *line, *saveptr, *text;
+    char when[32];
+    struct tm tm;
+    int count = 0;
+
+    for (line = strtok_r(block, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        int64_t ms = strtoll(line, &text, 10);
+        if (*text == ' ')
+            text++;
+        if ((since && ms < since) || (until && ms > until) || (re && regexec(re, text, 0, NULL, 0) != 0))
+            continue;
+
+        time_t secs = ms / 1000;
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(out, "%s.%03d %s\n", when, (int)(ms % 1000), text);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * shows the archived output of servname between since and until,
+ * optionally only the lines matching pattern (an extended regex).
+ * only the blocks whose time range overlaps [since, until] are
+ * decompressed. pages through less if stdout is a terminal.
+**/
+int showlog(char servname[], time_t since, time_t until, char *pattern) {
+    int64_t *segs;
+    struct logindex *idx;
+    regex_t re;
+    int segfd;
+
+    if (pattern && regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "error: bad pattern %s\n", pattern);
+        return 1;
+    }
+
+    if (!(segs = malloc(LOGMAXSEGMENTS * sizeof(int64_t)))) malloc_fail();
+    int nsegs = log_segments(servname, segs, LOGMAXSEGMENTS);
+    if (nsegs == 0) {
+        fprintf(stderr, "error: no output of %s archived\n", servname);
+        free(segs);
+        return 1;
+    }
+
+    FILE *out = isatty(1) ? popen("less", "we") : NULL;
+    if (!out)
+        out = stdout;
+
+    int64_t from = (int64_t)since * 1000, to = until ? (int64_t)until * 1000 + 999 : 0;
+    for (int i = 0; i < nsegs; i++) {
+        /* segments end where the next one starts */
+        if (to && segs[i] > to)
+            break;
+        if (from && i + 1 < nsegs && segs[i + 1] < from)
+            continue;
+
+        int blocks = log_index(servname, segs[i], &idx, &segfd);
+        for (int b = 0; b < blocks; b++) {
+            if ((from && idx[b].last < from) || (to && idx[b].first > to))
+                continue;
+            char *block = log_block(segfd, &idx[b]);
+            if (block) {
+                log_print(out, block, from, to, pattern ? &re : NULL);
+                free(block);
             }
         }
+        if (blocks)
+            close(segfd);
+        free(idx);
     }
+
+    if (out != stdout)
+        pclose(out);
+    if (pattern)
+        regfree(&re);
+    free(segs);
+
+    return 0;
 }
 
-int daemon_send(unsigned char command, char servname[]) {
-    /* open cmd fifo as write-only */
-    int cmdfd = open(CMDFIFOPATH, O_WRONLY);
-    if (cmdfd < 0) {
-        if (errno == ENOENT) {
-            fprintf(stderr, "could not connect to kanrisha daemon, it is most likely not running.\n");
-            return -3;
+/**
+ * prints the last lines lines of the archived output of servname,
+ * decompressing blocks from the newest backwards until it has them.
+**/
+void log_tail(char servname[], int lines) {
+    int64_t *segs;
+    struct logindex *idx;
+    char *blocks[64];
+    int nblocks = 0, found = 0, segfd;
+
+    if (!(segs = malloc(LOGMAXSEGMENTS * sizeof(int64_t)))) malloc_fail();
+    int nsegs = log_segments(servname, segs, LOGMAXSEGMENTS);
+
+    for (int i = nsegs - 1; i >= 0 && found < lines && nblocks < 64; i--) {
+        int count = log_index(servname, segs[i], &idx, &segfd);
+        for (int b = count - 1; b >= 0 && found < lines && nblocks < 64; b--) {
+            char *block = log_block(segfd, &idx[b]);
+            if (!block)
+                continue;
+            for (char *c = block; *c; c++)
+                found += *c == '\n';
+            blocks[nblocks++] = block;
         }
-        perror("open");
+        if (count)
+            close(segfd);
+        free(idx);
+    }
+    free(segs);
+
+    /* skip the lines of the oldest block that are too many */
+    for (int i = nblocks - 1; i >= 0; i--) {
+        char *start = blocks[i];
+        for (; found > lines && *start; start++)
+            found -= *start == '\n';
+        log_print(stdout, start, 0, 0, NULL);
+        free(blocks[i]);
+    }
+}
+
+/**
+ * maps the lifecycle journal, creating or resetting it if needed.
+ * writable is only set by the daemon. a journal of another layout
+ * is replaced by a fresh file rather than rewritten in place, since
+ * readers may still have it mapped.
+**/
+struct journal *journal_map(int writable) {
+    size_t size = sizeof(struct journal) + JOURNALRECORDS * sizeof(struct journalrec);
+    char fname[sizeof(JOURNALPATH) + 4];
+    struct journal *jnl;
+    struct stat st;
+
+    if (writable) {
+        char dirname[sizeof(JOURNALPATH)] = JOURNALPATH;
+        *strrchr(dirname, '/') = '\0';
+        mkdir(dirname, 0755);
+    }
+
+    int fd = open(JOURNALPATH, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+        jnl = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (jnl == MAP_FAILED)
+            return NULL;
+        if (jnl->magic == JOURNALMAGIC && jnl->size == size)
+            return jnl;
+        munmap(jnl, size);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (!writable)
+        return NULL;
+
+    snprintf(fname, sizeof(fname), "%s.new", JOURNALPATH);
+    fd = open(fname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) != 0
+        || (jnl = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(fname);
+        return NULL;
+    }
+    close(fd);
+
+    jnl->size = size;
+    jnl->next = 1;
+    jnl->magic = JOURNALMAGIC;
+    if (rename(fname, JOURNALPATH) != 0) {
+        sys_perror("journal_map(): rename");
+        munmap(jnl, size);
+        unlink(fname);
+        return NULL;
+    }
+    return jnl;
+}
+
+/**
+ * finds the journal's index entry for servname,
+ * adding one if add is set. returns -1 if there is none,
+ * which includes names too long to be stored whole.
+**/
+int journal_slot(struct journal *jnl, char servname[], int add) {
+    if (strlen(servname) >= sizeof(jnl->servs[0].name))
         return -1;
+
+    for (uint32_t i = 0; i < jnl->nservs; i++) {
+        if (!strcmp(jnl->servs[i].name, servname))
+            return i;
     }
+    if (!add || jnl->nservs == MAXSERVICES)
+        return -1;
 
-    write(cmdfd, &command, sizeof(unsigned char));
+    snprintf(jnl->servs[jnl->nservs].name, sizeof(jnl->servs[jnl->nservs].name), "%s", servname);
+    jnl->servs[jnl->nservs].last = 0;
+    return jnl->nservs++;
+}
+
+/**
+ * appends a record for serv. records of one service are chained
+ * backwards through prev, starting at the index entry's last.
+**/
+void journal_append(struct service *serv, int event, int32_t data) {
+    if (journal == NULL || serv->jslot < 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint64_t seq = journal->next;
+    struct journalrec *rec = &journal->recs[(seq - 1) % JOURNALRECORDS];
+
+    /* readers check seq last, so invalidate the slot first */
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELEASE);
+    rec->time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    rec->prev = journal->servs[serv->jslot].last;
+    rec->serv = serv->jslot;
+    rec->event = event;
+    rec->data = data;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&journal->servs[serv->jslot].last, seq, __ATOMIC_RELEASE);
+    journal->next = seq + 1;
+}
+
+/**
+ * parses a point in time: seconds since the epoch, a relative time
+ * like 30m, 2h or 7d ago, or a date like 2021-03-14 [15:09[:26]].
+ * returns -1 if it is none of these.
+**/
+time_t parse_time(char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    struct tm tm;
+
+    if (end != str && *end == '\0')
+        return value;
+    if (end != str && end[1] == '\0') {
+        switch (*end) {
+            case 's': return time(NULL) - value;
+            case 'm': return time(NULL) - value * 60;
+            case 'h': return time(NULL) - value * 3600;
+            case 'd': return time(NULL) - value * 86400;
+        }
+    }
+
+    char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, formats[i], &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+    }
+    return -1;
+}
+
+/**
+ * prints the lifecycle history of a service, oldest first. it walks
+ * the service's chain from the newest record back to since, so it
+ * never looks at records of other services.
+**/
+int history(char servname[], time_t since) {
+    struct journal *jnl = journal_map(0);
+    if (jnl == NULL) {
+        fprintf(stderr, "error: cannot open journal %s\n", JOURNALPATH);
+        return 1;
+    }
+
+    int slot = journal_slot(jnl, servname, 0);
+    if (slot < 0) {
+        fprintf(stderr, "error: no history for %s\n", servname);
+        return 1;
+    }
 
-    if (servname != NULL) {
-        write(cmdfd, servname, sizeof(char) * (strlen(servname) + 1));
+    struct journalrec *found = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t seq = __atomic_load_n(&jnl->servs[slot].last, __ATOMIC_ACQUIRE);
+    while (seq != 0) {
+        struct journalrec rec = jnl->recs[(seq - 1) % JOURNALRECORDS];
+        /* overwritten since, the rest of the chain is gone too */
+        if (__atomic_load_n(&jnl->recs[(seq - 1) % JOURNALRECORDS].seq, __ATOMIC_ACQUIRE) != seq || rec.seq != seq)
+            break;
+        if (rec.time / 1000 < since)
+            break;
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            if (!(found = realloc(found, cap * sizeof(struct journalrec)))) malloc_fail();
+        }
+        found[count++] = rec;
+        seq = rec.prev;
+    }
+
+    while (count-- > 0) {
+        struct journalrec *rec = &found[count];
+        time_t sec = rec->time / 1000;
+        char stamp[32];
+        struct tm tm;
+
+        char detail[32] = "";
+        char *event = rec->event < JNL_EVENTS ? journalevents[rec->event] : "unknown";
+        switch (rec->event) {
+            case JNL_START:
+                snprintf(detail, sizeof(detail), "pid %d", rec->data);
+                break;
+            case JNL_EXIT:
+                snprintf(detail, sizeof(detail), "code %d", WEXITSTATUS(rec->data));
+                break;
+            case JNL_SIGNAL:
+                snprintf(detail, sizeof(detail), "signal %d", WTERMSIG(rec->data));
+                break;
+            case JNL_RESTART:
+                snprintf(detail, sizeof(detail), "#%d", rec->data);
+                break;
+            case JNL_SHED:
+                snprintf(detail, sizeof(detail), "%s", rec->data == SHED_FREEZE ? "frozen" : "stopped");
+                break;
+        }
+
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+        if (*detail)
+            printf("%s.%03d  %-8s %s\n", stamp, (int)(rec->time % 1000), event, detail);
+        else
+            printf("%s.%03d  %s\n", stamp, (int)(rec->time % 1000), event);
     }
+    free(found);
 
     return 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2 && argc != 3) {
+    unsigned char flags = 0;
+    if (argc > 2 && !strcmp(argv[argc - 1], "--json")) {
+        flags |= QUERY_JSON;
+        argc--;
+    }
+    if (argc < 2 || argc > 9) {
         help();
         return 1;
     }
@@ -762,20 +4959,59 @@ int main(int argc, char *argv[]) {
         return daemon_send(0x1D, NULL);
     } else if (!strcmp(argv[1], "restart") && argc == 3) {
         return daemon_send(0x1E, argv[2]);
+    } else if (!strcmp(argv[1], "reload") && argc == 3) {
+        return query(0x1F, 0, argv[2]);
+    } else if (!strcmp(argv[1], "status") && (argc == 2 || !strcmp(argv[2], "--all"))) {
+        return query(0x2C, flags, NULL);
+    } else if (!strcmp(argv[1], "status") && argc == 3 && flags) {
+        return query(0x2D, flags, argv[2]);
     } else if (!strcmp(argv[1], "status") && argc == 3) {
         return status(argv[2]);
-    } else if (!strcmp(argv[1], "log") && argc == 3) {
-        return showlog(argv[2]);
+    } else if (!strcmp(argv[1], "log") && argc >= 3 && argc % 2 == 1) {
+        time_t since = 0, until = 0;
+        char *pattern = NULL;
+        for (int i = 3; i < argc; i += 2) {
+            time_t *bound = !strcmp(argv[i], "--since") ? &since : !strcmp(argv[i], "--until") ? &until : NULL;
+            if (!strcmp(argv[i], "--grep")) {
+                pattern = argv[i + 1];
+            } else if (!bound) {
+                help();
+                return 1;
+            } else if ((*bound = parse_time(argv[i + 1])) == -1) {
+                fprintf(stderr, "error: cannot parse time %s\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        return showlog(argv[2], since, until, pattern);
     } else if (!strcmp(argv[1], "list") && argc == 2) {
         return list(0, 0);
     } else if (!strcmp(argv[1], "list") && !strcmp(argv[2], "enabled")) {
         return list(1, 0);
     } else if (!strcmp(argv[1], "list") && !strcmp(argv[2], "running")) {
-        return list(0, 1);
+        return query(0x3C, flags, NULL);
+    } else if (!strcmp(argv[1], "list") && !strcmp(argv[2], "timers")) {
+        return query(0x3D, flags, NULL);
+    } else if (!strcmp(argv[1], "isolate") && argc == 3) {
+        return query(0x5A, 0, argv[2]);
     } else if (!strcmp(argv[1], "enable") && argc == 3) {
         return daemon_send(0x4A, argv[2]);
     } else if (!strcmp(argv[1], "disable") && argc == 3) {
         return daemon_send(0x4B, argv[2]);
+    } else if (!strcmp(argv[1], "history") && argc == 3) {
+        return history(argv[2], 0);
+    } else if (!strcmp(argv[1], "history") && argc == 5 && !strcmp(argv[3], "--since")) {
+        time_t since = parse_time(argv[4]);
+        if (since == -1) {
+            fprintf(stderr, "error: cannot parse time %s\n", argv[4]);
+            return 1;
+        }
+        return history(argv[2], since);
+    } else if (!strcmp(argv[1], "metrics") && argc == 2) {
+        return show_metrics();
+    } else if (!strcmp(argv[1], "compile") && argc == 2) {
+        return compile();
+    } else if (!strcmp(argv[1], "timings") && argc == 2) {
+        return timings();
     } else if (!strcmp(argv[1], "daemon") && argc == 2) {
         return rundaemon();
     } else {